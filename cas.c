@@ -0,0 +1,136 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+#include <nettle/base16.h>
+
+#include "s3blkdev.h"
+
+/* content-addressed objects: chunks of devices with dedup enabled are
+   stored once as CAS_FOLDER/<sha256 of object>, the device's own object
+   for the chunk is just a reference to it. casdir optionally keeps a
+   local copy of the objects, shared by all devices */
+
+int cas_hash (char *obj, size_t len, unsigned char *digest, char *hex,
+              char const **errstr)
+{
+  int res;
+
+  res = gnutls_hash_fast(GNUTLS_DIG_SHA256, obj, len, digest);
+  if (res != GNUTLS_E_SUCCESS) {
+    *errstr = gnutls_strerror(res);
+    return -1;
+  }
+
+  cas_hex(digest, hex);
+
+  return 0;
+}
+
+void cas_hex (unsigned char *digest, char *hex)
+{
+  base16_encode_update(hex, CAS_DIGEST_SIZE, digest);
+  hex[CAS_HEX_SIZE - 1] = '\0';
+}
+
+/* read a local copy of an object; returns 1 if there is none */
+int cas_load (char *casdir, char *hex, char *buf, size_t buflen,
+              size_t *len, char const **errstr)
+{
+  char path[PATH_MAX];
+  struct stat st;
+  ssize_t res;
+  int fd, result = -1;
+
+  snprintf(path, sizeof(path), "%s/%s", casdir, hex);
+
+  if ((fd = open(path, O_RDONLY)) < 0) {
+    if (errno == ENOENT)
+      return 1;
+    goto ERROR;
+  }
+
+  if (fstat(fd, &st) != 0)
+    goto ERROR1;
+
+  if ((size_t) st.st_size > buflen) {
+    errno = EFBIG;
+    goto ERROR1;
+  }
+
+  res = read(fd, buf, st.st_size);
+  if (res != st.st_size) {
+    if (res >= 0)
+      errno = EIO;
+    goto ERROR1;
+  }
+
+  *len = res;
+
+  result = 0;
+
+ERROR1:
+  if (result != 0)
+    *errstr = strerror(errno);
+
+  close(fd);
+
+  return result;
+
+ERROR:
+  *errstr = strerror(errno);
+
+  return -1;
+}
+
+/* keep a local copy of an object; written under a temporary name, so
+   readers never see partial objects */
+int cas_store (char *casdir, char *hex, char *buf, size_t len,
+               char const **errstr)
+{
+  char path[PATH_MAX], tmppath[PATH_MAX];
+  ssize_t res;
+  size_t written;
+  int fd;
+
+  snprintf(path, sizeof(path), "%s/%s", casdir, hex);
+  snprintf(tmppath, sizeof(tmppath), "%s/.%s.%i.%lx", casdir, hex, getpid(),
+           (unsigned long) pthread_self());
+
+  fd = open(tmppath, O_WRONLY|O_CREAT|O_EXCL, S_IRUSR|S_IWUSR|S_IRGRP);
+  if (fd < 0)
+    goto ERROR;
+
+  for (written = 0; written < len; written += res) {
+    res = write(fd, buf + written, len - written);
+    if (res < 0) {
+      if (errno != EINTR)
+        goto ERROR1;
+      res = 0;
+    }
+  }
+
+  if ((close(fd) != 0) || (rename(tmppath, path) != 0)) {
+    *errstr = strerror(errno);
+    unlink(tmppath);
+    return -1;
+  }
+
+  return 0;
+
+ERROR1:
+  *errstr = strerror(errno);
+  close(fd);
+  unlink(tmppath);
+  return -1;
+
+ERROR:
+  *errstr = strerror(errno);
+  return -1;
+}
@@ -0,0 +1,613 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stddef.h>
+#include <time.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "s3blkdev.h"
+
+/* the chunk map of a device lives in its cachedir. s3blkdevd bumps the
+   generation of a chunk after each write to it, s3blkdev-sync records
+   the generation it has uploaded; a chunk is dirty while both differ.
+   s3blkdev-sync also records the md5 of each object it uploads, so it
+   knows what S3 holds without asking. s3blkdevd records when and how
+   often each chunk is used, for s3blkdev-sync to evict by, and flags
+   the chunks complete in cachedir, so neither has to scan it. for a
+   device with a cachefile, the map also tells which slot holds which
+   chunk, see slots.c.
+
+   s3blkdevd keeps the map locked while running. if it went down without
+   closing the map, the map may have missed writes, so s3blkdevd marks
+   all chunks dirty and looks up the cached ones on its next start, and
+   s3blkdev-sync ignores the map until then */
+
+/* bytes of the map file locked by s3blkdevd: MAP_LOCK_DAEMON while it is
+   running, MAP_LOCK_NOMAP from its start on. s3blkdev-sync holds the
+   latter shared while working without the map */
+#define MAP_LOCK_DAEMON 0
+#define MAP_LOCK_NOMAP 1
+
+static size_t chunkmap_size (uint64_t num_chunks, uint32_t num_slots)
+{
+  return sizeof(struct chunkmap) + num_chunks * sizeof(struct chunkmap_entry) +
+         num_slots * sizeof(uint32_t);
+}
+
+static int chunkmap_valid (struct chunkmap *map, uint64_t num_chunks,
+                           uint32_t num_slots)
+{
+  return ((map->magic == CHUNKMAP_MAGIC) &&
+          (map->version == CHUNKMAP_VERSION) &&
+          (map->num_chunks == num_chunks) &&
+          (map->num_slots == num_slots));
+}
+
+/* set up a new map, or mark all chunks of a stale one dirty; returns 1
+   if the cached chunks must be looked up */
+static int chunkmap_recover (struct chunkmap *map, uint64_t num_chunks,
+                             uint32_t num_slots)
+{
+  uint64_t i;
+  int stale = !map->clean;
+
+  if (!chunkmap_valid(map, num_chunks, num_slots)) {
+    stale = 1;
+    memset(map, 0, chunkmap_size(num_chunks, num_slots));
+    map->magic = CHUNKMAP_MAGIC;
+    map->version = CHUNKMAP_VERSION;
+    map->num_chunks = num_chunks;
+    map->num_slots = num_slots;
+  }
+
+  if (stale) {
+    for (i = 0; i < num_chunks; i++)
+      map->entries[i].gen = map->entries[i].synced_gen + 1;
+  }
+
+  __sync_synchronize();
+  map->clean = 1;
+
+  return stale;
+}
+
+/* flag the complete chunks below dir_fd, descending levels deep into
+   the subdirectories of the hashed layout. closes dir_fd */
+static int chunkmap_scan_dir (struct chunkmap *map, int dir_fd, int levels)
+{
+  struct chunkmap_entry *entry;
+  struct dirent *de;
+  struct stat st;
+  unsigned long long chunk_no;
+  size_t len;
+  char *end;
+  DIR *dir;
+  int fd, err;
+
+  dir = fdopendir(dir_fd);
+  if (dir == NULL) {
+    err = errno;
+    close(dir_fd);
+    errno = err;
+    return -1;
+  }
+
+  for (errno = 0; (de = readdir(dir)) != NULL; errno = 0) {
+    len = strlen(de->d_name);
+
+    if ((len == 2) && (levels > 0) && (de->d_type == DT_DIR) &&
+        (de->d_name[0] != '.')) {
+      fd = openat(dirfd(dir), de->d_name, O_RDONLY|O_DIRECTORY);
+      if ((fd < 0) || (chunkmap_scan_dir(map, fd, levels - 1) != 0))
+        goto ERROR;
+      continue;
+    }
+
+    if (len != 16)
+      continue;
+
+    chunk_no = strtoull(de->d_name, &end, 16);
+    if ((*end != '\0') || (chunk_no >= map->num_chunks))
+      continue;
+
+    if (fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+      if (errno == ENOENT)
+        continue;
+      goto ERROR;
+    }
+
+    if (!S_ISREG(st.st_mode) || (st.st_size != CHUNKSIZE))
+      continue;
+
+    entry = &map->entries[chunk_no];
+    entry->flags |= CHUNK_CACHED;
+    /* chunks from before the map count as last used when last accessed */
+    if (entry->atime == 0)
+      entry->atime = st.st_atim.tv_sec;
+  }
+
+  if (errno != 0)
+    goto ERROR;
+
+  closedir(dir);
+
+  return 0;
+
+ERROR:
+  err = errno;
+  closedir(dir);
+  errno = err;
+  return -1;
+}
+
+/* flag the complete chunks in cachedir, the only full scan of it. chunks
+   of a cache being migrated may be in either layout */
+static int chunkmap_scan (struct device *dev, struct chunkmap *map)
+{
+  uint64_t i;
+  int fd;
+
+  for (i = 0; i < map->num_chunks; i++)
+    map->entries[i].flags &= ~CHUNK_CACHED;
+
+  fd = open(dev->cachedir, O_RDONLY|O_DIRECTORY);
+  if (fd < 0)
+    return -1;
+
+  return chunkmap_scan_dir(map, fd, 2);
+}
+
+/* lock a range of the map file, or report who holds it */
+static int chunkmap_lock (int fd, int cmd, short type, off_t start, off_t len)
+{
+  struct flock flk;
+
+  flk.l_type = type;
+  flk.l_whence = SEEK_SET;
+  flk.l_start = start;
+  flk.l_len = len;
+  flk.l_pid = 0;
+
+  if (fcntl(fd, cmd, &flk) != 0)
+    return -1;
+
+  return (cmd == F_OFD_GETLK ? flk.l_type : 0);
+}
+
+/* s3blkdevd passes daemon, which creates or repairs the map; returns 1
+   if s3blkdev-sync cannot use the map. it then keeps MAP_LOCK_NOMAP
+   until chunkmap_close(), as it can only lock chunk files, which
+   s3blkdevd does not */
+int chunkmap_open (struct device *dev, int daemon, char const **errstr)
+{
+  char path[PATH_MAX];
+  struct chunkmap *map;
+  struct stat st;
+  uint64_t num_chunks, i;
+  size_t len;
+  int fd, nomap = 0, res;
+
+  if ((dev->cachefile[0] != '\0') && (slots_open(dev, daemon, errstr) != 0))
+    return -1;
+
+  num_chunks = (dev->size + CHUNKSIZE - 1) / CHUNKSIZE;
+  len = chunkmap_size(num_chunks, dev->num_slots);
+
+  if (snprintf(path, sizeof(path), "%s/%s", dev->cachedir,
+               CHUNKMAP_FILE) >= (int) sizeof(path)) {
+    errno = ENAMETOOLONG;
+    goto ERROR;
+  }
+
+  fd = open(path, O_RDWR|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP);
+  if (fd < 0) {
+    if (!daemon && (errno == ENOENT)) {
+      slots_close(dev);
+      return 1;
+    }
+    goto ERROR;
+  }
+
+  if (daemon) {
+    /* wait for s3blkdev-sync working without the map, but fail if
+       another s3blkdevd uses the same cachedir */
+    if (chunkmap_lock(fd, F_OFD_SETLK, F_WRLCK, MAP_LOCK_NOMAP, 1) != 0) {
+      res = chunkmap_lock(fd, F_OFD_GETLK, F_WRLCK, MAP_LOCK_DAEMON, 1);
+      if (res < 0)
+        goto ERROR1;
+      if (res != F_UNLCK) {
+        errno = EBUSY;
+        goto ERROR1;
+      }
+      if (chunkmap_lock(fd, F_OFD_SETLKW, F_WRLCK, MAP_LOCK_NOMAP, 1) != 0)
+        goto ERROR1;
+    }
+  } else {
+    /* only succeeds while s3blkdevd is neither running nor starting */
+    nomap = (chunkmap_lock(fd, F_OFD_SETLK, F_RDLCK, MAP_LOCK_NOMAP, 1) == 0);
+  }
+
+  if (fstat(fd, &st) != 0)
+    goto ERROR1;
+
+  if ((size_t) st.st_size != len) {
+    if (!daemon)
+      goto NOMAP;
+    if ((ftruncate(fd, 0) != 0) || (ftruncate(fd, len) != 0))
+      goto ERROR1;
+  }
+
+  map = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    goto ERROR1;
+
+  if (daemon) {
+    if (chunkmap_recover(map, num_chunks, dev->num_slots) &&
+        ((dev->num_slots ? slots_recover(dev, map) :
+                           chunkmap_scan(dev, map)) != 0))
+      goto ERROR2;
+
+    /* a previous s3blkdevd's holds are void, s3blkdev-sync's may not be */
+    for (i = 0; i < num_chunks; i++)
+      map->entries[i].lock &= ~(CHUNK_LOCK_READERS|CHUNK_LOCK_EXCL|
+                                CHUNK_LOCK_WAITERS);
+
+    if (msync(map, len, MS_SYNC) != 0)
+      goto ERROR2;
+
+    if (chunkmap_lock(fd, F_OFD_SETLK, F_WRLCK, MAP_LOCK_DAEMON, 1) != 0)
+      goto ERROR2;
+
+    /* from now on, the map is only complete while s3blkdevd is running */
+    map->clean = 0;
+    if (msync(map, len, MS_SYNC) != 0)
+      goto ERROR2;
+  } else if (nomap) {
+    if (!chunkmap_valid(map, num_chunks, dev->num_slots) || !map->clean) {
+      munmap(map, len);
+      goto NOMAP;
+    }
+
+    /* s3blkdevd may start now, it will respect our locks in the map */
+    if (chunkmap_lock(fd, F_OFD_SETLK, F_UNLCK, MAP_LOCK_NOMAP, 1) != 0)
+      goto ERROR2;
+  } else {
+    res = chunkmap_lock(fd, F_OFD_GETLK, F_WRLCK, MAP_LOCK_DAEMON, 1);
+    if (res < 0)
+      goto ERROR2;
+
+    if (!chunkmap_valid(map, num_chunks, dev->num_slots) ||
+        (res == F_UNLCK)) {
+      *errstr = "s3blkdevd is starting";
+      munmap(map, len);
+      close(fd);
+      slots_close(dev);
+      return -1;
+    }
+  }
+
+  dev->chunkmap = map;
+  dev->chunkmap_fd = fd;
+
+  return 0;
+
+NOMAP:
+  if (!nomap) {
+    *errstr = "s3blkdevd is starting";
+    close(fd);
+    slots_close(dev);
+    return -1;
+  }
+
+  dev->chunkmap_fd = fd;
+  slots_close(dev);
+  return 1;
+
+ERROR2:
+  *errstr = strerror(errno);
+  munmap(map, len);
+  close(fd);
+  slots_close(dev);
+  return -1;
+
+ERROR1:
+  *errstr = strerror(errno);
+  close(fd);
+  slots_close(dev);
+  return -1;
+
+ERROR:
+  *errstr = strerror(errno);
+  slots_close(dev);
+  return -1;
+}
+
+/* s3blkdevd marks the map clean once all its writes are in */
+int chunkmap_close (struct device *dev, int daemon, char const **errstr)
+{
+  struct chunkmap *map = dev->chunkmap;
+  size_t len;
+  int result = 0;
+
+  if (map == NULL) {
+    if (dev->chunkmap_fd >= 0)
+      close(dev->chunkmap_fd);
+    dev->chunkmap_fd = -1;
+    return 0;
+  }
+
+  len = chunkmap_size(map->num_chunks, map->num_slots);
+
+  /* the slots hold what the map says once their writes are in, too */
+  if (daemon && (dev->num_slots > 0) && (fdatasync(dev->cachefile_fd) != 0)) {
+    *errstr = strerror(errno);
+    result = -1;
+  } else if (daemon) {
+    if (msync(map, len, MS_SYNC) == 0) {
+      map->clean = 1;
+      result = msync(map, len, MS_SYNC);
+    } else {
+      result = -1;
+    }
+
+    if (result != 0)
+      *errstr = strerror(errno);
+  }
+
+  munmap(map, len);
+  close(dev->chunkmap_fd);
+  dev->chunkmap = NULL;
+  dev->chunkmap_fd = -1;
+  slots_close(dev);
+
+  return result;
+}
+
+/* path must hold CHUNK_PATH_SIZE bytes. the hashed layout spreads
+   consecutive chunks over all subdirectories */
+void chunk_path (char *name, int hashed, char *path)
+{
+  if (hashed)
+    snprintf(path, CHUNK_PATH_SIZE, "%.2s/%.2s/%s", name + 14, name + 12,
+             name);
+  else
+    snprintf(path, CHUNK_PATH_SIZE, "%s", name);
+}
+
+/* move a chunk still in the other layout into the device's. whoever is
+   about to open a chunk that is missing calls this first, so a cache can
+   be migrated while in use. linkat() never replaces a chunk in place, and
+   the chunk's inode and locks stay the same. returns 1 if it moved the
+   chunk, 0 if there was none to move, or -1 */
+int chunk_migrate (int dir_fd, struct device *dev, char *name)
+{
+  char from[CHUNK_PATH_SIZE], to[CHUNK_PATH_SIZE];
+  int i;
+
+  chunk_path(name, !dev->hashed, from);
+  chunk_path(name, dev->hashed, to);
+
+  for (i = 2; dev->hashed && (i <= 5); i += 3) {
+    to[i] = '\0';
+    if ((mkdirat(dir_fd, to, S_IRWXU|S_IRGRP|S_IXGRP) != 0) &&
+        (errno != EEXIST))
+      return -1;
+    to[i] = '/';
+  }
+
+  if (linkat(dir_fd, from, dir_fd, to, 0) != 0)
+    return (((errno == ENOENT) || (errno == EEXIST)) ? 0 : -1);
+
+  if ((unlinkat(dir_fd, from, 0) != 0) && (errno != ENOENT))
+    return -1;
+
+  return 1;
+}
+
+/* keep the access statistics s3blkdev-sync evicts by. they survive the
+   chunk's eviction, so a chunk coming back counts as used again, unless it
+   has been gone for longer than the cache keeps chunks. called with the
+   chunk locked and complete, so also flag it as cached */
+void chunk_touch (struct device *dev, uint64_t chunk_no)
+{
+  struct chunkmap *map = dev->chunkmap;
+  struct chunkmap_entry *entry;
+  uint32_t now;
+
+  if ((map == NULL) || (chunk_no >= map->num_chunks))
+    return;
+
+  entry = &map->entries[chunk_no];
+  now = time(NULL);
+
+  if (now - entry->atime >= HEAT_CORRELATION) {
+    if (entry->atime < map->horizon)
+      entry->refs = 1;
+    else if (entry->refs < UINT32_MAX)
+      entry->refs++;
+  }
+
+  if (entry->atime != now)
+    entry->atime = now;
+
+  if (!(entry->flags & CHUNK_CACHED))
+    __sync_fetch_and_or(&entry->flags, CHUNK_CACHED);
+}
+
+/* a chunk just fetched is cached as S3 holds it, which the manifest
+   records from its ETag, so s3blkdev-sync neither has to read it back nor
+   ask S3 to tell. called with the chunk locked exclusive */
+void chunk_fetched (struct device *dev, uint64_t chunk_no,
+                    unsigned char *md5)
+{
+  static const unsigned char unknown[16];
+  struct chunkmap_entry *entry;
+
+  if ((dev->chunkmap == NULL) || (chunk_no >= dev->chunkmap->num_chunks) ||
+      !memcmp(md5, unknown, sizeof(unknown)))
+    return;
+
+  entry = &dev->chunkmap->entries[chunk_no];
+  memcpy(entry->md5, md5, 16);
+  entry->verified = time(NULL);
+  __sync_synchronize();
+  entry->synced_gen = entry->gen;
+}
+
+/* the range of the map file holding the entry of chunk_no */
+#define ENTRY_OFFS(chunk_no) (offsetof(struct chunkmap, entries) + \
+                              (chunk_no) * sizeof(struct chunkmap_entry))
+
+static void chunk_wake (uint32_t *lock)
+{
+  __sync_fetch_and_and(lock, ~CHUNK_LOCK_WAITERS);
+  syscall(SYS_futex, lock, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/* drop the holds of a crashed s3blkdev-sync, whose OFD lock on the entry
+   is gone with it. fd is any descriptor of the map file but the caller's
+   own one, if it holds the entry itself */
+static void chunk_reap (int fd, struct device *dev, uint64_t chunk_no)
+{
+  uint32_t *lock = &dev->chunkmap->entries[chunk_no].lock, old = *lock;
+
+  if (!(old & (CHUNK_LOCK_SYNC_READERS|CHUNK_LOCK_SYNC_EXCL)) ||
+      (chunkmap_lock(fd, F_OFD_GETLK, F_WRLCK, ENTRY_OFFS(chunk_no),
+                     sizeof(struct chunkmap_entry)) != F_UNLCK))
+    return;
+
+  /* fails if s3blkdev-sync took the chunk meanwhile */
+  if (__sync_bool_compare_and_swap(lock, old, old &
+        ~(CHUNK_LOCK_SYNC_READERS|CHUNK_LOCK_SYNC_EXCL)))
+    syslog(LOG_WARNING, "%s/%016llx: dropped stale lock\n", dev->cachedir,
+           (unsigned long long) chunk_no);
+}
+
+/* for an s3blkdevd thread; an exclusive lock is meant for fetching the
+   chunk only, which must not be cached completely meanwhile */
+void chunk_lock (struct device *dev, uint64_t chunk_no, int excl)
+{
+  uint32_t *lock = &dev->chunkmap->entries[chunk_no].lock, old;
+  struct timespec ts;
+
+  for (;;) {
+    old = *lock;
+
+    if (excl ? !(old & ~CHUNK_LOCK_WAITERS) :
+               !(old & (CHUNK_LOCK_EXCL|CHUNK_LOCK_SYNC_EXCL))) {
+      if (__sync_bool_compare_and_swap(lock, old,
+                                       excl ? old | CHUNK_LOCK_EXCL : old + 1))
+        return;
+      continue;
+    }
+
+    if (!(old & CHUNK_LOCK_WAITERS) &&
+        !__sync_bool_compare_and_swap(lock, old, old | CHUNK_LOCK_WAITERS))
+      continue;
+
+    /* look for a crashed s3blkdev-sync every now and then */
+    ts.tv_sec = 1;
+    ts.tv_nsec = 0;
+    if ((syscall(SYS_futex, lock, FUTEX_WAIT, old | CHUNK_LOCK_WAITERS, &ts,
+                 NULL, 0) != 0) && (errno == ETIMEDOUT))
+      chunk_reap(dev->chunkmap_fd, dev, chunk_no);
+  }
+}
+
+/* once the chunk is fetched */
+void chunk_downgrade (struct device *dev, uint64_t chunk_no)
+{
+  uint32_t *lock = &dev->chunkmap->entries[chunk_no].lock, old;
+
+  do {
+    old = *lock;
+  } while (!__sync_bool_compare_and_swap(lock, old,
+                                         (old & ~CHUNK_LOCK_EXCL) + 1));
+
+  if (old & CHUNK_LOCK_WAITERS)
+    chunk_wake(lock);
+}
+
+void chunk_unlock (struct device *dev, uint64_t chunk_no, int excl)
+{
+  uint32_t *lock = &dev->chunkmap->entries[chunk_no].lock, old;
+
+  if (excl)
+    old = __sync_fetch_and_and(lock, ~CHUNK_LOCK_EXCL);
+  else
+    old = __sync_fetch_and_sub(lock, 1);
+
+  if (old & CHUNK_LOCK_WAITERS)
+    chunk_wake(lock);
+}
+
+/* for s3blkdev-sync or the write-back, shared to upload the chunk and
+   exclusive to evict it. doesn't wait for s3blkdevd's threads, but fails
+   with EAGAIN. returns the descriptor holding the OFD lock, which
+   chunk_unlock_sync() closes */
+int chunk_lock_sync (struct device *dev, uint64_t chunk_no, int excl)
+{
+  uint32_t *lock = &dev->chunkmap->entries[chunk_no].lock, old;
+  char path[PATH_MAX];
+  int fd;
+
+  if (snprintf(path, sizeof(path), "%s/%s", dev->cachedir,
+               CHUNKMAP_FILE) >= (int) sizeof(path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  fd = open(path, O_RDWR);
+  if (fd < 0)
+    return -1;
+
+  if (chunkmap_lock(fd, F_OFD_SETLK, excl ? F_WRLCK : F_RDLCK,
+                    ENTRY_OFFS(chunk_no), sizeof(struct chunkmap_entry)) != 0)
+    goto ERROR;
+
+  chunk_reap(fd, dev, chunk_no);
+
+  do {
+    old = *lock;
+    if (excl ? (old & ~CHUNK_LOCK_WAITERS) :
+               (old & (CHUNK_LOCK_EXCL|CHUNK_LOCK_SYNC_EXCL))) {
+      errno = EAGAIN;
+      goto ERROR;
+    }
+  } while (!__sync_bool_compare_and_swap(lock, old, excl ?
+             old | CHUNK_LOCK_SYNC_EXCL : old + CHUNK_LOCK_SYNC_ONE));
+
+  return fd;
+
+ERROR:
+  close(fd);
+  return -1;
+}
+
+void chunk_unlock_sync (struct device *dev, uint64_t chunk_no, int excl,
+                        int fd)
+{
+  uint32_t *lock = &dev->chunkmap->entries[chunk_no].lock, old;
+
+  if (excl)
+    old = __sync_fetch_and_and(lock, ~CHUNK_LOCK_SYNC_EXCL);
+  else
+    old = __sync_fetch_and_sub(lock, CHUNK_LOCK_SYNC_ONE);
+
+  if (old & CHUNK_LOCK_WAITERS)
+    chunk_wake(lock);
+
+  /* only now, lest the hold above looks stale */
+  close(fd);
+}
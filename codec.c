@@ -0,0 +1,837 @@
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+#include <snappy-c.h>
+#ifdef USE_LZ4
+#  include <lz4.h>
+#  include <lz4hc.h>
+#endif
+#ifdef USE_ZSTD
+#  include <zstd.h>
+#endif
+
+#include "s3blkdev.h"
+
+/* object header:
+   0..3   magic
+   4      header version
+   5      codec
+   6      log2 of block size (version 2)
+   7      flags
+   8..11  uncompressed length, little endian
+   12..15 crc32 of uncompressed data, little endian
+
+   version 1 objects hold a single compressed stream. version 2 objects
+   split the data into blocks, which are compressed independently; the
+   header is followed by the compressed length of each block (bit 31
+   set if the block is stored raw), followed by the blocks. raw objects
+   (CODEC_NONE) never have blocks.
+
+   encrypted objects (CODEC_ENCRYPTED) are always split into blocks.
+   each block is prefixed with its nonce and followed by its AES-256-GCM
+   tag; the lengths in the table include both. the nonce is a keyed hash
+   of the block and its position, so equal chunks yield equal objects,
+   which keeps etag comparison and dedup working. encrypted objects carry
+   no crc32, which would give away the plaintext. unless they are
+   content-addressed, encrypted objects are bound to their device and
+   chunk number too (CODEC_BOUND), so S3 cannot hand out one chunk's
+   object for another's; objects written before are still read
+
+   objects without this header were written by older versions and are
+   plain snappy */
+#define CODEC_MAGIC "s3bd"
+#define CODEC_VERSION 2
+#define CODEC_BLOCK_SHIFT 20
+#define CODEC_MIN_BLOCK_SHIFT 16
+#define CODEC_MAX_BLOCK_SHIFT 24
+#define CODEC_MAX_BLOCKS (CHUNKSIZE >> CODEC_MIN_BLOCK_SHIFT)
+#define CODEC_RAW_BLOCK 0x80000000
+#define CODEC_ENCRYPTED 0x01
+#define CODEC_BOUND 0x02
+#define CODEC_NONCE_SIZE 12
+#define CODEC_TAG_SIZE 16
+#define CODEC_CRYPT_OVERHEAD (CODEC_NONCE_SIZE + CODEC_TAG_SIZE)
+#define CODEC_NONCE_INFO "s3blkdev nonce key"
+#define CODEC_AAD_SIZE 9
+#define CODEC_MAX_AAD_SIZE (CODEC_AAD_SIZE + 8 + DEVNAME_SIZE)
+
+/* compressibility test before compressing a whole chunk */
+#define CODEC_SAMPLES 4
+#define CODEC_SAMPLE_SIZE (64 * 1024)
+
+/* the blocks of one chunk, processed by the caller and the pool */
+struct codec_job {
+  int compress;
+  int codec;
+  int level;
+  unsigned char *key; // NULL unless encrypted
+  const char *devname; // NULL unless bound to the device and chunk_no
+  uint64_t chunk_no;
+  char *src;
+  char *dst;
+  size_t len; // uncompressed length
+  size_t block_size;
+  size_t slot_size; // distance of compressed blocks before packing
+  size_t offs[CODEC_MAX_BLOCKS]; // of compressed blocks in src
+  uint32_t lens[CODEC_MAX_BLOCKS];
+  uLong crcs[CODEC_MAX_BLOCKS];
+  unsigned int num_blocks;
+  unsigned int next_block;
+  unsigned int done_blocks;
+  const char *errstr;
+  struct codec_job *next;
+};
+
+static struct {
+  pthread_mutex_t mtx;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  struct codec_job *jobs;
+} pool = {
+  PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+  PTHREAD_COND_INITIALIZER, NULL
+};
+
+static const char *codec_names[] = {
+  [CODEC_NONE] = "none",
+  [CODEC_SNAPPY] = "snappy",
+  [CODEC_LZ4] = "lz4",
+  [CODEC_ZSTD] = "zstd"
+};
+
+static void put_le32 (unsigned char *p, uint32_t u32)
+{
+  p[0] = u32;
+  p[1] = u32 >> 8;
+  p[2] = u32 >> 16;
+  p[3] = u32 >> 24;
+}
+
+static uint32_t get_le32 (unsigned char *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+int codec_by_name (char *name)
+{
+  unsigned int i;
+
+  for (i = 0; i < sizeof(codec_names)/sizeof(codec_names[0]); i++) {
+    if ((codec_names[i] != NULL) && !strcmp(name, codec_names[i]))
+      break;
+  }
+
+  switch (i) {
+    case CODEC_NONE:
+    case CODEC_SNAPPY:
+#ifdef USE_LZ4
+    case CODEC_LZ4:
+#endif
+#ifdef USE_ZSTD
+    case CODEC_ZSTD:
+#endif
+      return i;
+  }
+
+  return -1;
+}
+
+/* compress without header; fails if the result does not fit into dst */
+static int codec_encode (int codec, int level, char *src, size_t srclen,
+                         char *dst, size_t *dstlen, char const **errstr)
+{
+#ifdef USE_LZ4
+  int res;
+#endif
+
+  /* only lz4 and zstd know about levels */
+  (void) level;
+
+  switch (codec) {
+    case CODEC_SNAPPY:
+      if (snappy_compress(src, srclen, dst, dstlen) != SNAPPY_OK) {
+        *errstr = "snappy_compress() failed";
+        return -1;
+      }
+      break;
+#ifdef USE_LZ4
+    case CODEC_LZ4:
+      /* a level selects the slower high compression mode */
+      if (level > 0)
+        res = LZ4_compress_HC(src, dst, srclen, *dstlen, level);
+      else
+        res = LZ4_compress_default(src, dst, srclen, *dstlen);
+      if (res <= 0) {
+        *errstr = "LZ4_compress() failed";
+        return -1;
+      }
+      *dstlen = res;
+      break;
+#endif
+#ifdef USE_ZSTD
+    case CODEC_ZSTD:
+      *dstlen = ZSTD_compress(dst, *dstlen, src, srclen,
+                              (level != 0 ? level : ZSTD_CLEVEL_DEFAULT));
+      if (ZSTD_isError(*dstlen)) {
+        *errstr = ZSTD_getErrorName(*dstlen);
+        return -1;
+      }
+      break;
+#endif
+    default:
+      *errstr = "unsupported codec";
+      return -1;
+  }
+
+  return 0;
+}
+
+/* uncompress a stream without header, which must yield exactly dstlen
+   bytes */
+static int codec_decode (int codec, char *src, size_t srclen, char *dst,
+                         size_t dstlen, char const **errstr)
+{
+  size_t len = dstlen;
+#ifdef USE_LZ4
+  int res;
+#endif
+
+  switch (codec) {
+    case CODEC_NONE:
+      if (srclen != len) {
+        *errstr = "raw data has wrong length";
+        return -1;
+      }
+      memcpy(dst, src, len);
+      break;
+    case CODEC_SNAPPY:
+      if (snappy_uncompress(src, srclen, dst, &len) != SNAPPY_OK) {
+        *errstr = "snappy_uncompress() failed";
+        return -1;
+      }
+      break;
+#ifdef USE_LZ4
+    case CODEC_LZ4:
+      res = LZ4_decompress_safe(src, dst, srclen, len);
+      if (res < 0) {
+        *errstr = "LZ4_decompress_safe() failed";
+        return -1;
+      }
+      len = res;
+      break;
+#endif
+#ifdef USE_ZSTD
+    case CODEC_ZSTD:
+      len = ZSTD_decompress(dst, len, src, srclen);
+      if (ZSTD_isError(len)) {
+        *errstr = ZSTD_getErrorName(len);
+        return -1;
+      }
+      break;
+#endif
+    default:
+      *errstr = "unsupported codec";
+      return -1;
+  }
+
+  if (len != dstlen) {
+    *errstr = "uncompressed length mismatch";
+    return -1;
+  }
+
+  return 0;
+}
+
+/* compress a few evenly spread samples; returns non-zero if they shrink
+   by less than min_saving percent */
+static int codec_incompressible (int codec, int level,
+                                 unsigned char min_saving, char *src,
+                                 size_t srclen, char const **errstr)
+{
+  char sample[CODEC_SAMPLE_SIZE + CODEC_SAMPLE_SIZE/4];
+  size_t i, len, total = 0;
+
+  if (srclen < CODEC_SAMPLES * CODEC_SAMPLE_SIZE * 4)
+    return 0;
+
+  for (i = 0; i < CODEC_SAMPLES; i++) {
+    len = sizeof(sample);
+    if (codec_encode(codec, level,
+                     src + i * (srclen / CODEC_SAMPLES), CODEC_SAMPLE_SIZE,
+                     sample, &len, errstr) != 0)
+      return 0;
+    total += len;
+  }
+
+  return (total * 100 >
+          (size_t) CODEC_SAMPLES * CODEC_SAMPLE_SIZE * (100 - min_saving));
+}
+
+/* data authenticated along with an encrypted block: its index, its
+   entry in the length table and the codec, then the chunk number and
+   the device name of bound objects. returns its length */
+static size_t codec_aad (struct codec_job *job, unsigned int i,
+                         unsigned char *aad)
+{
+  size_t len;
+
+  put_le32(aad, i);
+  put_le32(aad + 4, job->lens[i]);
+  aad[8] = job->codec;
+
+  if (job->devname == NULL)
+    return CODEC_AAD_SIZE;
+
+  put_le32(aad + CODEC_AAD_SIZE, job->chunk_no);
+  put_le32(aad + CODEC_AAD_SIZE + 4, job->chunk_no >> 32);
+  len = strnlen(job->devname, DEVNAME_SIZE);
+  memcpy(aad + CODEC_AAD_SIZE + 8, job->devname, len);
+
+  return CODEC_AAD_SIZE + 8 + len;
+}
+
+/* encrypt len bytes at in to block, behind the nonce, which is a keyed
+   hash of what gets encrypted; in may point into block */
+static const char *codec_encrypt (struct codec_job *job, unsigned int i,
+                                  char *in, size_t len, char *block)
+{
+  gnutls_datum_t key = { job->key, CODEC_KEY_SIZE };
+  gnutls_aead_cipher_hd_t cipher;
+  gnutls_hmac_hd_t hmac;
+  unsigned char digest[32], aad[CODEC_MAX_AAD_SIZE];
+  size_t aadlen, outlen = len + CODEC_TAG_SIZE;
+  int res;
+
+  aadlen = codec_aad(job, i, aad);
+
+  res = gnutls_hmac_init(&hmac, GNUTLS_MAC_SHA256, job->key + CODEC_KEY_SIZE,
+                         CODEC_KEY_SIZE);
+  if (res != GNUTLS_E_SUCCESS)
+    return gnutls_strerror(res);
+
+  if (((res = gnutls_hmac(hmac, aad, aadlen)) != GNUTLS_E_SUCCESS) ||
+      ((res = gnutls_hmac(hmac, in, len)) != GNUTLS_E_SUCCESS)) {
+    gnutls_hmac_deinit(hmac, NULL);
+    return gnutls_strerror(res);
+  }
+
+  gnutls_hmac_deinit(hmac, digest);
+  memcpy(block, digest, CODEC_NONCE_SIZE);
+
+  res = gnutls_aead_cipher_init(&cipher, GNUTLS_CIPHER_AES_256_GCM, &key);
+  if (res != GNUTLS_E_SUCCESS)
+    return gnutls_strerror(res);
+
+  res = gnutls_aead_cipher_encrypt(cipher, block, CODEC_NONCE_SIZE,
+                                   aad, aadlen, CODEC_TAG_SIZE, in, len,
+                                   block + CODEC_NONCE_SIZE, &outlen);
+  gnutls_aead_cipher_deinit(cipher);
+
+  return (res != GNUTLS_E_SUCCESS ? gnutls_strerror(res) : NULL);
+}
+
+/* decrypt a block of len bytes to out, which may point into the block;
+   outlen is the room in out on entry */
+static const char *codec_decrypt (struct codec_job *job, unsigned int i,
+                                  char *block, size_t len, char *out,
+                                  size_t *outlen)
+{
+  gnutls_datum_t key = { job->key, CODEC_KEY_SIZE };
+  gnutls_aead_cipher_hd_t cipher;
+  unsigned char aad[CODEC_MAX_AAD_SIZE];
+  size_t aadlen;
+  int res;
+
+  if (len < CODEC_CRYPT_OVERHEAD)
+    return "truncated block";
+
+  res = gnutls_aead_cipher_init(&cipher, GNUTLS_CIPHER_AES_256_GCM, &key);
+  if (res != GNUTLS_E_SUCCESS)
+    return gnutls_strerror(res);
+
+  aadlen = codec_aad(job, i, aad);
+
+  res = gnutls_aead_cipher_decrypt(cipher, block, CODEC_NONCE_SIZE,
+                                   aad, aadlen, CODEC_TAG_SIZE,
+                                   block + CODEC_NONCE_SIZE,
+                                   len - CODEC_NONCE_SIZE, out, outlen);
+  gnutls_aead_cipher_deinit(cipher);
+
+  return (res != GNUTLS_E_SUCCESS ? gnutls_strerror(res) : NULL);
+}
+
+/* process one block; compressed blocks which do not shrink are stored
+   raw. encryption and decryption happen right here, while the block is
+   still in the cache */
+static const char *codec_block (struct codec_job *job, unsigned int i)
+{
+  char *in, *out, *data;
+  size_t len, blocklen, plainlen;
+  const char *errstr = NULL;
+  int raw;
+
+  blocklen = MIN(job->block_size, job->len - i * job->block_size);
+
+  if (job->compress) {
+    in = data = job->src + i * job->block_size;
+    out = job->dst + i * job->slot_size;
+    len = job->slot_size;
+
+    if (job->key != NULL) {
+      out += CODEC_NONCE_SIZE;
+      len -= CODEC_CRYPT_OVERHEAD;
+    }
+
+    if ((job->codec == CODEC_NONE) ||
+        (codec_encode(job->codec, job->level, in, blocklen, out, &len,
+                      &errstr) != 0) || (len >= blocklen)) {
+      /* encrypting copies the block anyway */
+      if (job->key == NULL)
+        memcpy(out, in, blocklen);
+      len = blocklen;
+      job->lens[i] = len | CODEC_RAW_BLOCK;
+    } else {
+      in = out;
+      job->lens[i] = len;
+    }
+
+    if (job->key != NULL) {
+      job->lens[i] += CODEC_CRYPT_OVERHEAD;
+      return codec_encrypt(job, i, in, len, out - CODEC_NONCE_SIZE);
+    }
+  } else {
+    in = job->src + job->offs[i];
+    len = job->lens[i] & ~CODEC_RAW_BLOCK;
+    out = data = job->dst + i * job->block_size;
+    raw = job->lens[i] & CODEC_RAW_BLOCK;
+
+    if (job->key != NULL) {
+      /* raw blocks are decrypted right into place, others in place */
+      plainlen = (raw ? blocklen : len);
+      errstr = codec_decrypt(job, i, in, len,
+                             (raw ? out : in + CODEC_NONCE_SIZE), &plainlen);
+      if (errstr != NULL)
+        return errstr;
+
+      if (raw)
+        return (plainlen != blocklen ? "raw data has wrong length" : NULL);
+
+      in += CODEC_NONCE_SIZE;
+      len = plainlen;
+    }
+
+    if (codec_decode((raw ? CODEC_NONE : job->codec), in, len, out,
+                     blocklen, &errstr) != 0)
+      return errstr;
+
+    /* authenticated by the cipher */
+    if (job->key != NULL)
+      return NULL;
+  }
+
+  job->crcs[i] = crc32(crc32(0, Z_NULL, 0), (unsigned char *) data,
+                       blocklen);
+
+  return NULL;
+}
+
+/* called with pool.mtx held */
+static void codec_block_done (struct codec_job *job, const char *errstr)
+{
+  if (errstr != NULL)
+    job->errstr = errstr;
+
+  if (++job->done_blocks == job->num_blocks)
+    pthread_cond_broadcast(&pool.done);
+}
+
+static void *codec_worker (void *arg __attribute__((unused)))
+{
+  struct codec_job *job;
+  const char *errstr;
+  unsigned int i;
+
+  pthread_mutex_lock(&pool.mtx);
+
+  for (;;) {
+    for (job = pool.jobs; job != NULL; job = job->next) {
+      if (job->next_block < job->num_blocks)
+        break;
+    }
+
+    if (job == NULL) {
+      pthread_cond_wait(&pool.work, &pool.mtx);
+      continue;
+    }
+
+    i = job->next_block++;
+    pthread_mutex_unlock(&pool.mtx);
+
+    errstr = codec_block(job, i);
+
+    pthread_mutex_lock(&pool.mtx);
+    codec_block_done(job, errstr);
+  }
+
+  return NULL;
+}
+
+/* hand out the blocks of a job to the pool, work on them as well, and
+   wait until all are done; returns the crc32 of the uncompressed data */
+static uLong codec_run (struct codec_job *job)
+{
+  struct codec_job **pjob;
+  const char *errstr;
+  unsigned int i;
+  uLong crc;
+
+  job->next_block = job->done_blocks = 0;
+  job->errstr = NULL;
+
+  pthread_mutex_lock(&pool.mtx);
+
+  job->next = pool.jobs;
+  pool.jobs = job;
+  if (job->num_blocks > 1)
+    pthread_cond_broadcast(&pool.work);
+
+  while (job->next_block < job->num_blocks) {
+    i = job->next_block++;
+    pthread_mutex_unlock(&pool.mtx);
+
+    errstr = codec_block(job, i);
+
+    pthread_mutex_lock(&pool.mtx);
+    codec_block_done(job, errstr);
+  }
+
+  while (job->done_blocks < job->num_blocks)
+    pthread_cond_wait(&pool.done, &pool.mtx);
+
+  for (pjob = &pool.jobs; *pjob != job; pjob = &(*pjob)->next);
+  *pjob = job->next;
+
+  pthread_mutex_unlock(&pool.mtx);
+
+  /* encrypted blocks carry no crc */
+  if (job->key != NULL)
+    return 0;
+
+  crc = job->crcs[0];
+  for (i = 1; i < job->num_blocks; i++) {
+    crc = crc32_combine(crc, job->crcs[i],
+                        MIN(job->block_size, job->len - i * job->block_size));
+  }
+
+  return crc;
+}
+
+int codec_start_workers (unsigned int num_threads, char const **errstr)
+{
+  pthread_t thread;
+  pthread_attr_t thread_attr;
+  unsigned int i;
+  int res;
+
+  if ((res = pthread_attr_init(&thread_attr)) != 0)
+    goto ERROR;
+
+  res = pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+  if (res != 0)
+    goto ERROR1;
+
+  for (i = 0; i < num_threads; i++) {
+    res = pthread_create(&thread, &thread_attr, &codec_worker, NULL);
+    if (res != 0)
+      goto ERROR1;
+  }
+
+  pthread_attr_destroy(&thread_attr);
+
+  return 0;
+
+ERROR1:
+  pthread_attr_destroy(&thread_attr);
+
+ERROR:
+  *errstr = strerror(res);
+
+  return -1;
+}
+
+/* pack the blocks of a job behind the length table; returns the length
+   of the object */
+static size_t codec_pack (struct codec_job *job, char *dst)
+{
+  size_t pos, len;
+  unsigned int i;
+
+  pos = CODEC_HEADER_SIZE + job->num_blocks * 4;
+
+  for (i = 0; i < job->num_blocks; i++) {
+    put_le32((unsigned char *) dst + CODEC_HEADER_SIZE + i * 4, job->lens[i]);
+    len = job->lens[i] & ~CODEC_RAW_BLOCK;
+    memmove(dst + pos, job->dst + i * job->slot_size, len);
+    pos += len;
+  }
+
+  return pos;
+}
+
+/* returns the codec used, which is CODEC_NONE if compressing saves less
+   than min_saving percent, or -1 on error. the object is encrypted unless
+   key is NULL, and bound to chunk_no of devname unless that is NULL */
+int chunk_compress (int codec, int level, unsigned char min_saving,
+                    unsigned char *key, const char *devname,
+                    uint64_t chunk_no, char *src, size_t srclen, char *dst,
+                    size_t *dstlen, char const **errstr)
+{
+  unsigned char *hdr = (unsigned char *) dst;
+  struct codec_job job;
+  size_t pos;
+  int fits;
+  uLong crc = 0;
+
+  if (*dstlen < CODEC_HEADER_SIZE + srclen) {
+    *errstr = "buffer too small";
+    return -1;
+  }
+
+  job.compress = 1;
+  job.codec = codec;
+  job.level = level;
+  job.key = key;
+  job.devname = (key != NULL ? devname : NULL);
+  job.chunk_no = chunk_no;
+  job.src = src;
+  job.len = srclen;
+  job.block_size = (size_t) 1 << CODEC_BLOCK_SHIFT;
+  job.num_blocks = (srclen + job.block_size - 1) / job.block_size;
+  /* leave room for snappy's worst case */
+  job.slot_size = job.block_size + job.block_size / 6 + 32;
+  if (key != NULL)
+    job.slot_size += CODEC_CRYPT_OVERHEAD;
+  pos = CODEC_HEADER_SIZE + job.num_blocks * 4;
+  job.dst = dst + pos;
+
+  fits = ((job.num_blocks <= CODEC_MAX_BLOCKS) &&
+          (pos + job.num_blocks * job.slot_size <= *dstlen));
+
+  if ((key != NULL) && !fits) {
+    *errstr = "buffer too small";
+    return -1;
+  }
+
+  if ((codec == CODEC_NONE) || (job.num_blocks == 0) || !fits ||
+      codec_incompressible(codec, level, min_saving, src, srclen, errstr)) {
+    codec = CODEC_NONE;
+  } else {
+    crc = codec_run(&job);
+    if (job.errstr != NULL)
+      goto ERROR;
+    pos = codec_pack(&job, dst);
+
+    if ((pos - CODEC_HEADER_SIZE) * 100 > srclen * (100 - min_saving))
+      codec = CODEC_NONE;
+  }
+
+  if ((codec == CODEC_NONE) && (key != NULL)) {
+    /* encrypted objects are made of blocks, even if stored raw */
+    job.codec = CODEC_NONE;
+    if (job.num_blocks > 0) {
+      codec_run(&job);
+      if (job.errstr != NULL)
+        goto ERROR;
+    }
+    pos = codec_pack(&job, dst);
+  } else if (codec == CODEC_NONE) {
+    memcpy(dst + CODEC_HEADER_SIZE, src, srclen);
+    pos = CODEC_HEADER_SIZE + srclen;
+    if (crc == 0)
+      crc = crc32(crc32(0, Z_NULL, 0), (unsigned char *) src, srclen);
+  }
+
+  memcpy(hdr, CODEC_MAGIC, 4);
+  hdr[4] = CODEC_VERSION;
+  hdr[5] = codec;
+  hdr[6] = ((codec == CODEC_NONE) && (key == NULL) ? 0 : CODEC_BLOCK_SHIFT);
+  hdr[7] = (key != NULL ? CODEC_ENCRYPTED : 0) |
+           (job.devname != NULL ? CODEC_BOUND : 0);
+  put_le32(hdr + 8, srclen);
+  put_le32(hdr + 12, crc);
+
+  *dstlen = pos;
+
+  return codec;
+
+ERROR:
+  *errstr = job.errstr;
+
+  return -1;
+}
+
+/* returns the codec of the object or -1 on error. encrypted objects are
+   decrypted in place, so src is clobbered. bound objects must be those of
+   chunk_no of devname */
+int chunk_uncompress (unsigned char *key, const char *devname,
+                      uint64_t chunk_no, char *src, size_t srclen,
+                      char *dst, size_t *dstlen, char const **errstr)
+{
+  unsigned char *hdr = (unsigned char *) src;
+  struct codec_job job;
+  size_t pos;
+  unsigned int i;
+  uLong crc;
+
+  /* legacy object */
+  if ((srclen < CODEC_HEADER_SIZE) || memcmp(hdr, CODEC_MAGIC, 4)) {
+    if (snappy_uncompress(src, srclen, dst, dstlen) != SNAPPY_OK) {
+      *errstr = "snappy_uncompress() failed";
+      return -1;
+    }
+    return CODEC_SNAPPY;
+  }
+
+  if ((hdr[4] != 1) && (hdr[4] != CODEC_VERSION)) {
+    *errstr = "unknown object header version";
+    return -1;
+  }
+
+  if ((hdr[7] & ~(CODEC_ENCRYPTED | CODEC_BOUND)) ||
+      ((hdr[7] & CODEC_BOUND) && !(hdr[7] & CODEC_ENCRYPTED))) {
+    *errstr = "unknown object flags";
+    return -1;
+  }
+
+  if ((hdr[7] & CODEC_ENCRYPTED) && (key == NULL)) {
+    *errstr = "object is encrypted, but no key is configured";
+    return -1;
+  }
+
+  if ((hdr[7] & CODEC_BOUND) && (devname == NULL)) {
+    *errstr = "object is bound to a chunk, but none is given";
+    return -1;
+  }
+
+  job.compress = 0;
+  job.codec = hdr[5];
+  job.key = (hdr[7] & CODEC_ENCRYPTED ? key : NULL);
+  job.devname = (hdr[7] & CODEC_BOUND ? devname : NULL);
+  job.chunk_no = chunk_no;
+  job.src = src;
+  job.dst = dst;
+  job.len = get_le32(hdr + 8);
+
+  if (job.len > *dstlen) {
+    *errstr = "buffer too small";
+    return -1;
+  }
+
+  pos = CODEC_HEADER_SIZE;
+
+  if ((hdr[4] == 1) || ((hdr[6] == 0) && (job.key == NULL))) {
+    /* single stream */
+    job.block_size = job.len;
+    job.num_blocks = 1;
+    job.offs[0] = pos;
+    job.lens[0] = srclen - pos;
+    if (job.codec == CODEC_NONE)
+      job.lens[0] |= CODEC_RAW_BLOCK;
+  } else {
+    if ((hdr[6] < CODEC_MIN_BLOCK_SHIFT) || (hdr[6] > CODEC_MAX_BLOCK_SHIFT)) {
+      *errstr = "invalid block size";
+      return -1;
+    }
+
+    job.block_size = (size_t) 1 << hdr[6];
+    job.num_blocks = (job.len + job.block_size - 1) / job.block_size;
+    if (job.num_blocks > CODEC_MAX_BLOCKS) {
+      *errstr = "too many blocks";
+      return -1;
+    }
+
+    pos += job.num_blocks * 4;
+    if (pos > srclen) {
+      *errstr = "truncated object";
+      return -1;
+    }
+
+    for (i = 0; i < job.num_blocks; i++) {
+      job.lens[i] = get_le32(hdr + CODEC_HEADER_SIZE + i * 4);
+      job.offs[i] = pos;
+      pos += job.lens[i] & ~CODEC_RAW_BLOCK;
+    }
+
+    if (pos != srclen) {
+      *errstr = "object length mismatch";
+      return -1;
+    }
+  }
+
+  if (job.len == 0) {
+    crc = crc32(0, Z_NULL, 0);
+  } else {
+    crc = codec_run(&job);
+    if (job.errstr != NULL) {
+      *errstr = job.errstr;
+      return -1;
+    }
+  }
+
+  if ((job.key == NULL) && (crc != get_le32(hdr + 12))) {
+    *errstr = "checksum mismatch";
+    return -1;
+  }
+
+  *dstlen = job.len;
+
+  return hdr[5];
+}
+
+/* derive the nonce key, which follows the encryption key in key */
+int codec_derive_key (unsigned char *key, char const **errstr)
+{
+  int res;
+
+  res = gnutls_hmac_fast(GNUTLS_MAC_SHA256, key, CODEC_KEY_SIZE,
+                         CODEC_NONCE_INFO, strlen(CODEC_NONCE_INFO),
+                         key + CODEC_KEY_SIZE);
+  if (res != GNUTLS_E_SUCCESS) {
+    *errstr = gnutls_strerror(res);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* a reference object points to a content-addressed object: it is the
+   header of that object with CODEC_REF as codec, followed by the digest
+   of the object */
+size_t chunk_make_ref (char *obj, unsigned char *digest, char *ref)
+{
+  memcpy(ref, obj, CODEC_HEADER_SIZE);
+  ref[5] = CODEC_REF;
+  ref[6] = 0;
+  memcpy(ref + CODEC_HEADER_SIZE, digest, CAS_DIGEST_SIZE);
+
+  return CODEC_REF_SIZE;
+}
+
+/* returns non-zero if obj is a reference object */
+int chunk_parse_ref (char *obj, size_t len, unsigned char *digest)
+{
+  unsigned char *hdr = (unsigned char *) obj;
+
+  if ((len != CODEC_REF_SIZE) || memcmp(hdr, CODEC_MAGIC, 4) ||
+      (hdr[4] != CODEC_VERSION) || (hdr[5] != CODEC_REF))
+    return 0;
+
+  memcpy(digest, obj + CODEC_HEADER_SIZE, CAS_DIGEST_SIZE);
+
+  return 1;
+}
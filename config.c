@@ -13,11 +13,15 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <time.h>
+#include <stdlib.h>
+#include <syslog.h>
 #include <netdb.h>
 #include <pthread.h>
+#include <linux/tls.h>
 #include <gnutls/gnutls.h>
 #include <gnutls/crypto.h>
 #include <nettle/base64.h>
+#include <nettle/base16.h>
 
 #include "s3blkdev.h"
 
@@ -25,6 +29,17 @@
 #define XSTR(a) #a
 #define STR(a) XSTR(a)
 
+/* happy eyeballs: delay between connection attempts in usec */
+#define S3_CONNECT_DELAY 250000
+
+/* sha256 of an empty payload */
+#define S3_EMPTY_SHA256 \
+  "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"
+
+/* tls record content types */
+#define TLS_RECORD_HANDSHAKE 22
+#define TLS_RECORD_DATA 23
+
 enum readwrite {
   READ,
   WRITE
@@ -51,9 +66,26 @@ static int is_incomplete (char *line)
   return ((strlen(line) == 0) || (line[strlen(line) - 1] != '\n'));
 }
 
+static int decode_key (char *hex, unsigned char *key, size_t keylen)
+{
+  struct base16_decode_ctx ctx;
+  size_t len;
+
+  if (strlen(hex) != 2 * keylen)
+    return -1;
+
+  base16_decode_init(&ctx);
+
+  if (!base16_decode_update(&ctx, &len, key, 2 * keylen, hex) ||
+      !base16_decode_final(&ctx) || (len != keylen))
+    return -1;
+
+  return 0;
+}
+
 static int validate_config (struct config *cfg, char const **errstr)
 {
-  unsigned int i;
+  unsigned int i, warmup = 0;
 
   if ((cfg->listen[0] == '\0') && (cfg->geom_listen[0] == '\0')) {
     *errstr = "no or empty listen statements";
@@ -90,6 +122,26 @@ static int validate_config (struct config *cfg, char const **errstr)
     return -1;
   }
 
+  if (cfg->num_uploaders == 0)
+    cfg->num_uploaders = 1;
+
+  if (cfg->num_uploaders >= MAX_IO_THREADS) {
+    *errstr = "number of uploaders too large (max. " STR(MAX_IO_THREADS) ")";
+    return -1;
+  }
+
+  if (cfg->num_writeback_threads >= MAX_IO_THREADS) {
+    *errstr = "number of write-back threads too large "
+              "(max. " STR(MAX_IO_THREADS) ")";
+    return -1;
+  }
+
+  if (cfg->num_codec_threads >= MAX_IO_THREADS) {
+    *errstr = "number of codec threads too large "
+              "(max. " STR(MAX_IO_THREADS) ")";
+    return -1;
+  }
+
   if (cfg->num_s3hosts == 0) {
     *errstr = "no s3hosts";
     return -1;
@@ -104,6 +156,44 @@ static int validate_config (struct config *cfg, char const **errstr)
     strcpy(cfg->s3ports[0], "443");
   }
 
+  /* prefer different host over different port */
+  for (i = 0; i < (unsigned int) cfg->num_s3hosts * cfg->num_s3ports; i++) {
+    cfg->s3endpoints[i].host = cfg->s3hosts[i % cfg->num_s3hosts];
+    cfg->s3endpoints[i].port = cfg->s3ports[i / cfg->num_s3hosts];
+  }
+  cfg->num_s3endpoints = i;
+
+  if (cfg->s3hedgepct >= 100) {
+    *errstr = "s3hedgepct must be below 100";
+    return -1;
+  }
+
+  if (cfg->warmup_max_used > 100) {
+    *errstr = "warmupmaxused must not exceed 100";
+    return -1;
+  }
+
+  if ((cfg->s3hedgepct > 0) && (cfg->s3hedgebudget == 0))
+    cfg->s3hedgebudget = 5;
+
+  if (cfg->s3rangeparts > S3_MAX_PARTS) {
+    *errstr = "s3rangeparts too large (max. " STR(S3_MAX_PARTS) ")";
+    return -1;
+  }
+
+  /* hedged GETs need a second connection while the first is still busy,
+     ranged GETs one connection per range, write-back one per thread, the
+     warm-up one */
+  for (i = 0; i < cfg->num_devices; i++)
+    warmup |= ((cfg->devs[i].heatfile[0] != '\0') && (cfg->warmup_rate > 0));
+
+  cfg->num_s3conns = MAX(cfg->s3hedgepct > 0 ? 2 : 1, cfg->s3rangeparts);
+  cfg->num_s3conns = MAX(cfg->num_s3fetchers * cfg->num_s3conns +
+                         cfg->num_writeback_threads + warmup,
+                         cfg->num_s3endpoints);
+  cfg->num_s3conns = MAX(cfg->num_s3conns, cfg->num_uploaders);
+  cfg->num_s3conns = MIN(cfg->num_s3conns, MAX_IO_THREADS);
+
   if (cfg->s3bucket[0] == '\0') {
     *errstr = "no or empty s3bucket statement";
     return -1;
@@ -119,7 +209,18 @@ static int validate_config (struct config *cfg, char const **errstr)
     return -1;
   }
 
+  if (cfg->s3connecttimeout == 0)
+    cfg->s3connecttimeout = cfg->s3timeout;
+
+  if (cfg->s3region[0] == '\0')
+    strcpy(cfg->s3region, "us-east-1");
+
   for (i = 0; i < cfg->num_devices; i++) {
+    if (!strcmp(cfg->devs[i].name, CAS_FOLDER)) {
+      *errstr = "device name " CAS_FOLDER " is reserved";
+      return -1;
+    }
+
     if (cfg->devs[i].size >= ((unsigned long)1 << (8 * sizeof(int) - 1)) * 4096) {
       *errstr = "Linux does not support NBD devices of or larger than 8 TB";
       return -1;
@@ -136,9 +237,15 @@ int load_config (char *configfile, struct config *cfg,
   int result = -1, in_device = 0;
   unsigned int i;
   char line[1024], tmp[256];
+  struct device *dev;
 
   *err_line = 0;
   memset(cfg, 0, sizeof(*cfg));
+  cfg->s3dnsttl = 60;
+  cfg->verify_interval = 7 * 24 * 3600;
+  cfg->writeback_age = 30;
+  cfg->warmup_rate = 32;
+  cfg->warmup_max_used = 80;
 
   for (i = 0; i < sizeof(cfg->s3conns)/sizeof(cfg->s3conns[0]); i++) {
     cfg->s3conns[i].sock = -1;
@@ -146,6 +253,17 @@ int load_config (char *configfile, struct config *cfg,
       goto ERROR;
   }
 
+  if (pthread_mutex_init(&cfg->s3sigkey.mtx, NULL) != 0)
+    goto ERROR;
+
+  if (pthread_mutex_init(&cfg->s3hedge.mtx, NULL) != 0)
+    goto ERROR;
+
+  for (i = 0; i < sizeof(cfg->s3endpoints)/sizeof(cfg->s3endpoints[0]); i++) {
+    if (pthread_mutex_init(&cfg->s3endpoints[i].mtx, NULL) != 0)
+      goto ERROR;
+  }
+
   if ((fh = fopen(configfile, "r")) == NULL) {
     *errstr = strerror(errno);
     goto ERROR;
@@ -163,22 +281,63 @@ int load_config (char *configfile, struct config *cfg,
       continue;
 
     if (in_device) {
-      if (sscanf(line, "cachedir %4095s",
-                 cfg->devs[cfg->num_devices].cachedir)) {
+      dev = &cfg->devs[cfg->num_devices];
+
+      if (sscanf(line, "cachedir %4095s", dev->cachedir)) {
         in_device |= 2;
-      } else if (sscanf(line, "size %lu", &cfg->devs[cfg->num_devices].size)) {
+        continue;
+      } else if (sscanf(line, "cachefile %4095s %llu", dev->cachefile,
+                        &dev->cachefile_size)) {
+        continue;
+      } else if (sscanf(line, "heatfile %4095s", dev->heatfile)) {
+        continue;
+      } else if (sscanf(line, "size %lu", &dev->size)) {
         in_device |= 4;
-      } else {
-        *errstr = "unknown device parameter";
-        goto ERROR1;
+        continue;
+      } else if (sscanf(line, "codec %15s %i", tmp, &dev->codec_level)) {
+        if ((dev->codec = codec_by_name(tmp)) < 0) {
+          *errstr = "unknown or unsupported codec";
+          goto ERROR1;
+        }
+        continue;
+      } else if (sscanf(line, "dedup %hhu", &dev->dedup)) {
+        continue;
+      } else if (sscanf(line, "direct %hhu", &dev->direct)) {
+        continue;
+      } else if (sscanf(line, "layout %15s", tmp)) {
+        if (!strcmp(tmp, "hashed")) {
+          dev->hashed = 1;
+        } else if (strcmp(tmp, "flat")) {
+          *errstr = "layout must be flat or hashed";
+          goto ERROR1;
+        }
+        continue;
+      } else if (sscanf(line, "encryptkey %255s", tmp)) {
+        if (decode_key(tmp, dev->key, CODEC_KEY_SIZE) != 0) {
+          *errstr = "encryptkey must be 64 hex digits";
+          goto ERROR1;
+        }
+        if (codec_derive_key(dev->key, errstr) != 0)
+          goto ERROR1;
+        dev->encrypt = 1;
+        continue;
+      } else if (sscanf(line, "minsaving %hhu", &dev->min_saving)) {
+        if (dev->min_saving > 100) {
+          *errstr = "minsaving must not exceed 100";
+          goto ERROR1;
+        }
+        continue;
       }
 
-      if (in_device == 7) {
-        cfg->num_devices++;
-        in_device = 0;
+      /* optional parameters may follow cachedir and size, so a device
+         ends with the first line that is no device parameter */
+      if (in_device != 7) {
+        *errstr = "unknown device parameter";
+        goto ERROR1;
       }
 
-      continue;
+      cfg->num_devices++;
+      in_device = 0;
     }
 
     if (sscanf(line, " listen %127s", cfg->listen) ||
@@ -187,13 +346,32 @@ int load_config (char *configfile, struct config *cfg,
         sscanf(line, " geom_port %7[0-9]", cfg->geom_port) ||
         sscanf(line, " workers %hu", &cfg->num_io_threads) ||
         sscanf(line, " fetchers %hu", &cfg->num_s3fetchers) ||
+        sscanf(line, " uploaders %hu", &cfg->num_uploaders) ||
+        sscanf(line, " verifyinterval %u", &cfg->verify_interval) ||
+        sscanf(line, " writeback %hu", &cfg->num_writeback_threads) ||
+        sscanf(line, " writebackage %u", &cfg->writeback_age) ||
+        sscanf(line, " writebackdirty %u", &cfg->writeback_dirty) ||
+        sscanf(line, " warmuprate %u", &cfg->warmup_rate) ||
+        sscanf(line, " warmupmaxused %hhu", &cfg->warmup_max_used) ||
+        sscanf(line, " codecthreads %hu", &cfg->num_codec_threads) ||
         sscanf(line, " s3maxreqsperconn %hu", &cfg->s3_max_reqs_per_conn) ||
         sscanf(line, " s3timeout %u", &cfg->s3timeout) ||
+        sscanf(line, " s3connecttimeout %u", &cfg->s3connecttimeout) ||
+        sscanf(line, " s3dnsttl %u", &cfg->s3dnsttl) ||
+        sscanf(line, " s3tcpnodelay %hhu", &cfg->s3tcpnodelay) ||
+        sscanf(line, " s3tcpfastopen %hhu", &cfg->s3tcpfastopen) ||
+        sscanf(line, " s3hedgepct %hhu", &cfg->s3hedgepct) ||
+        sscanf(line, " s3hedgebudget %hhu", &cfg->s3hedgebudget) ||
+        sscanf(line, " s3rangeparts %hu", &cfg->s3rangeparts) ||
         sscanf(line, " s3ssl %hhu", &cfg->s3ssl) ||
+        sscanf(line, " s3ktls %hhu", &cfg->s3ktls) ||
+        sscanf(line, " s3sigv4 %hhu", &cfg->s3sigv4) ||
+        sscanf(line, " s3region %63s", cfg->s3region) ||
         sscanf(line, " s3name %127s", cfg->s3name) ||
         sscanf(line, " s3bucket %127s", cfg->s3bucket) ||
         sscanf(line, " s3accesskey %127s", cfg->s3accesskey) ||
-        sscanf(line, " s3secretkey %127s", cfg->s3secretkey))
+        sscanf(line, " s3secretkey %127s", cfg->s3secretkey) ||
+        sscanf(line, " casdir %4095s", cfg->casdir))
       continue;
 
     /* s3host */
@@ -230,6 +408,17 @@ int load_config (char *configfile, struct config *cfg,
       }
 
       strncpy(cfg->devs[cfg->num_devices].name, tmp, sizeof(cfg->devs[0].name));
+      cfg->devs[cfg->num_devices].codec = CODEC_SNAPPY;
+      cfg->devs[cfg->num_devices].min_saving = 10;
+      cfg->devs[cfg->num_devices].direct_align = DIRECT_ALIGN;
+      cfg->devs[cfg->num_devices].chunkmap_fd = -1;
+      for (i = 0; i < DIRECT_LOCKS; i++) {
+        if (pthread_mutex_init(&cfg->devs[cfg->num_devices].direct_mtx[i],
+                               NULL) != 0) {
+          *errstr = "pthread_mutex_init() failed";
+          goto ERROR1;
+        }
+      }
       in_device = 1;
 
       continue;
@@ -239,7 +428,9 @@ int load_config (char *configfile, struct config *cfg,
     goto ERROR1;
   }
 
-  if (in_device) {
+  if (in_device == 7) {
+    cfg->num_devices++;
+  } else if (in_device) {
     *errstr = "incomplete device configuration";
     goto ERROR1;
   }
@@ -290,7 +481,17 @@ int save_pidfile (char *pidfile)
   return 0;
 }
 
-int set_socket_options (int sock)
+static unsigned int usec_since (struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - start->tv_sec) * 1000000 +
+         (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+int set_socket_options (int sock, int flags)
 {
   int opt;
 
@@ -306,38 +507,221 @@ int set_socket_options (int sock)
   if (setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &opt, sizeof(opt)) == -1)
     return -1;
 
+  opt = 1;
+  if ((flags & SOCKOPT_NODELAY) &&
+      (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt)) == -1))
+    return -1;
+
+  /* SYN is sent along with the first write, if we have a cookie */
+  opt = 1;
+  if ((flags & SOCKOPT_FASTOPEN) &&
+      (setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &opt,
+                  sizeof(opt)) == -1))
+    return -1;
+
   return 0;
 }
 
-static int s3_connect (struct s3connection *conn, char const **errstr)
+/* get addresses of an endpoint, resolve them at most every s3dnsttl seconds;
+   address families are interleaved, so that connecting in parallel tries
+   both IPv6 and IPv4 early */
+static int s3_resolve (struct config *cfg, struct s3endpoint *ep,
+                       struct sockaddr_storage *addrs, socklen_t *addrlens,
+                       char const **errstr)
 {
   struct addrinfo hints, *result, *walk;
-  int res;
+  struct addrinfo *fam[2][S3_MAX_ADDRS];
+  unsigned int num_fam[2] = { 0, 0 }, i, j, k;
+  time_t now = time(NULL);
+  int res, gai, num_addrs = -1;
+
+  if ((res = pthread_mutex_lock(&ep->mtx)) != 0) {
+    *errstr = strerror(res);
+    return -1;
+  }
+
+  if ((ep->num_addrs > 0) && (ep->addrs_expire > now))
+    goto COPY;
+
+  pthread_mutex_unlock(&ep->mtx);
 
   memset(&hints, 0, sizeof(hints));
   hints.ai_family = AF_UNSPEC;
   hints.ai_socktype = SOCK_STREAM;
 
-  res = getaddrinfo(conn->host, conn->port, &hints, &result);
-  if (res != 0) {
-    *errstr = gai_strerror(res);
+  gai = getaddrinfo(ep->host, ep->port, &hints, &result);
+
+  if ((res = pthread_mutex_lock(&ep->mtx)) != 0) {
+    *errstr = strerror(res);
+    if (gai == 0)
+      freeaddrinfo(result);
     return -1;
   }
 
+  if (gai != 0) {
+    /* keep using stale addresses while the resolver is unavailable */
+    *errstr = gai_strerror(gai);
+    if (ep->num_addrs > 0)
+      goto COPY;
+    goto ERROR;
+  }
+
   for (walk = result; walk != NULL; walk = walk->ai_next) {
-    conn->sock = socket(walk->ai_family, walk->ai_socktype, 0);
-    if ((conn->sock >= 0) &&
-        (set_socket_options(conn->sock) == 0) &&
-        (connect(conn->sock, walk->ai_addr, walk->ai_addrlen) == 0))
+    i = (walk->ai_family != result->ai_family);
+    if (num_fam[i] < S3_MAX_ADDRS)
+      fam[i][num_fam[i]++] = walk;
+  }
+
+  for (i = j = k = 0; (k < S3_MAX_ADDRS) && ((i < num_fam[0]) ||
+                                             (j < num_fam[1])); k++) {
+    walk = (((i <= j) && (i < num_fam[0])) || (j >= num_fam[1]) ?
+            fam[0][i++] : fam[1][j++]);
+
+    memcpy(&ep->addrs[k], walk->ai_addr, walk->ai_addrlen);
+    ep->addrlens[k] = walk->ai_addrlen;
+  }
+
+  freeaddrinfo(result);
+
+  ep->num_addrs = k;
+  ep->addrs_expire = now + cfg->s3dnsttl;
+
+COPY:
+  num_addrs = ep->num_addrs;
+  memcpy(addrs, ep->addrs, sizeof(ep->addrs[0]) * num_addrs);
+  memcpy(addrlens, ep->addrlens, sizeof(ep->addrlens[0]) * num_addrs);
+
+ERROR:
+  pthread_mutex_unlock(&ep->mtx);
+
+  return num_addrs;
+}
+
+/* happy eyeballs: start a non-blocking connect to the next address every
+   S3_CONNECT_DELAY usec while no earlier attempt succeeded, first one
+   to connect wins */
+static int s3_connect (struct config *cfg, struct s3connection *conn,
+                       char const **errstr)
+{
+  struct sockaddr_storage addrs[S3_MAX_ADDRS];
+  socklen_t addrlens[S3_MAX_ADDRS], len;
+  int socks[S3_MAX_ADDRS], num_addrs, num_socks = 0, next = 0, i, res, sock,
+      flags, maxfd, err;
+  unsigned int elapsed, next_attempt = 0, timeout, wait;
+  struct timespec start;
+  struct timeval tv;
+  fd_set fds;
+
+  num_addrs = s3_resolve(cfg, conn->endpoint, addrs, addrlens, errstr);
+  if (num_addrs < 0)
+    return -1;
+
+  flags = (cfg->s3tcpnodelay ? SOCKOPT_NODELAY : 0) |
+          (cfg->s3tcpfastopen ? SOCKOPT_FASTOPEN : 0);
+  timeout = cfg->s3connecttimeout * 1000;
+  conn->sock = -1;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (;;) {
+    elapsed = usec_since(&start);
+
+    if ((next < num_addrs) && ((num_socks == 0) || (elapsed >= next_attempt))) {
+      sock = socket(addrs[next].ss_family, SOCK_STREAM, 0);
+
+      if ((sock < 0) ||
+          (set_socket_options(sock, flags) != 0) ||
+          (fcntl(sock, F_SETFL, O_NONBLOCK) != 0)) {
+        *errstr = strerror(errno);
+        if (sock >= 0)
+          close(sock);
+      } else if (connect(sock, (struct sockaddr*) &addrs[next],
+                         addrlens[next]) == 0) {
+        /* immediate success, e.g. TCP fast open */
+        conn->sock = sock;
+      } else if (errno == EINPROGRESS) {
+        socks[num_socks++] = sock;
+      } else {
+        *errstr = strerror(errno);
+        close(sock);
+      }
+
+      next++;
+      next_attempt = elapsed + S3_CONNECT_DELAY;
+    }
+
+    if ((conn->sock >= 0) || ((num_socks == 0) && (next >= num_addrs)))
+      break;
+
+    if (num_socks == 0)
+      continue;
+
+    if (elapsed >= timeout) {
+      *errstr = "timeout while connecting";
+      break;
+    }
+
+    FD_ZERO(&fds);
+    for (i = 0, maxfd = -1; i < num_socks; i++) {
+      FD_SET(socks[i], &fds);
+      maxfd = MAX(maxfd, socks[i]);
+    }
+
+    wait = (next < num_addrs ? MIN(next_attempt, timeout) : timeout);
+    wait = (wait > elapsed ? wait - elapsed : 0);
+    tv.tv_sec = wait / 1000000;
+    tv.tv_usec = wait % 1000000;
+
+    res = select(maxfd + 1, NULL, &fds, NULL, &tv);
+    if (res < 0) {
+      if (errno == EINTR)
+        continue;
+      *errstr = strerror(errno);
+      break;
+    }
+
+    for (i = 0; (res > 0) && (i < num_socks);) {
+      if (!FD_ISSET(socks[i], &fds)) {
+        i++;
+        continue;
+      }
+
+      len = sizeof(err);
+      if (getsockopt(socks[i], SOL_SOCKET, SO_ERROR, &err, &len) != 0)
+        err = errno;
+
+      if ((err == 0) && (conn->sock < 0)) {
+        conn->sock = socks[i];
+      } else {
+        if (err != 0) {
+          /* failed, do not wait before trying the next address */
+          *errstr = strerror(err);
+          next_attempt = 0;
+        }
+        close(socks[i]);
+      }
+
+      socks[i] = socks[--num_socks];
+    }
+
+    if (conn->sock >= 0)
       break;
+  }
 
+  for (i = 0; i < num_socks; i++)
+    close(socks[i]);
+
+  if (conn->sock < 0)
+    return -1;
+
+  if (fcntl(conn->sock, F_SETFL, 0) != 0) {
     *errstr = strerror(errno);
     close(conn->sock);
+    conn->sock = -1;
+    return -1;
   }
 
-  freeaddrinfo(result);
-
-  return (walk == NULL ? -1 : 0);
+  return 0;
 }
 
 static int s3_tls_handshake (struct s3connection *conn, char const **errstr)
@@ -358,7 +742,93 @@ static int s3_tls_handshake (struct s3connection *conn, char const **errstr)
   return 0;
 }
 
-static int s3_tls_setup (struct s3connection *conn, char const **errstr)
+/* hand the keys of an established session over to kernel tls, so
+   records are en- and decrypted by the kernel; returns the offloaded
+   directions, 0 if neither the kernel nor the cipher support it. reading
+   stays with gnutls if it decrypted data already, which the kernel would
+   never hand out */
+static int s3_ktls_setup (struct s3connection *conn)
+{
+  union {
+    struct tls_crypto_info info;
+    struct tls12_crypto_info_aes_gcm_128 gcm128;
+    struct tls12_crypto_info_aes_gcm_256 gcm256;
+  } ci;
+  gnutls_protocol_t version;
+  gnutls_cipher_algorithm_t cipher;
+  gnutls_datum_t iv, key;
+  unsigned char seq[8], *ci_iv, *ci_key, *ci_salt, *ci_seq;
+  size_t keylen;
+  socklen_t cilen;
+  int read, ret = 0;
+
+  version = gnutls_protocol_get_version(conn->tls_sess);
+  if ((version != GNUTLS_TLS1_2) && (version != GNUTLS_TLS1_3))
+    return 0;
+
+  memset(&ci, 0, sizeof(ci));
+  ci.info.version = (version == GNUTLS_TLS1_2 ?
+                     TLS_1_2_VERSION : TLS_1_3_VERSION);
+
+  cipher = gnutls_cipher_get(conn->tls_sess);
+  if (cipher == GNUTLS_CIPHER_AES_128_GCM) {
+    ci.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+    ci_iv = ci.gcm128.iv;
+    ci_key = ci.gcm128.key;
+    ci_salt = ci.gcm128.salt;
+    ci_seq = ci.gcm128.rec_seq;
+    keylen = sizeof(ci.gcm128.key);
+    cilen = sizeof(ci.gcm128);
+  } else if (cipher == GNUTLS_CIPHER_AES_256_GCM) {
+    ci.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+    ci_iv = ci.gcm256.iv;
+    ci_key = ci.gcm256.key;
+    ci_salt = ci.gcm256.salt;
+    ci_seq = ci.gcm256.rec_seq;
+    keylen = sizeof(ci.gcm256.key);
+    cilen = sizeof(ci.gcm256);
+  } else {
+    return 0;
+  }
+
+  if (setsockopt(conn->sock, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) != 0)
+    return 0;
+
+  for (read = 0; read <= 1; read++) {
+    if (read && (gnutls_record_check_pending(conn->tls_sess) > 0))
+      break;
+
+    if ((gnutls_record_get_state(conn->tls_sess, read, NULL, &iv, &key,
+                                 seq) != GNUTLS_E_SUCCESS) ||
+        (key.size != keylen) || (iv.size < 4))
+      break;
+
+    /* gcm nonce: 4 bytes implicit salt plus 8 bytes, which are the
+       explicit record sequence in tls 1.2 and part of the iv in 1.3 */
+    memcpy(ci_key, key.data, keylen);
+    memcpy(ci_salt, iv.data, 4);
+    memcpy(ci_seq, seq, 8);
+    if (version == GNUTLS_TLS1_2)
+      memcpy(ci_iv, seq, 8);
+    else if (iv.size == 12)
+      memcpy(ci_iv, iv.data + 4, 8);
+    else
+      break;
+
+    if (setsockopt(conn->sock, SOL_TLS, (read ? TLS_RX : TLS_TX), &ci,
+                   cilen) != 0)
+      break;
+
+    ret |= (read ? S3_KTLS_RX : S3_KTLS_TX);
+  }
+
+  memset(&ci, 0, sizeof(ci));
+
+  return ret;
+}
+
+static int s3_tls_setup (struct config *cfg, struct s3connection *conn,
+                         char const **errstr)
 {
   int res;
 
@@ -393,6 +863,7 @@ static int s3_tls_setup (struct s3connection *conn, char const **errstr)
     goto ERROR2;
 
   conn->is_ssl = 1;
+  conn->ktls = (cfg->s3ktls != 0 ? s3_ktls_setup(conn) : 0);
 
   return 0;
 
@@ -409,75 +880,245 @@ ERROR:
   return -1;
 }
 
-struct s3connection *s3_get_conn (struct config *cfg, unsigned int *conn_num,
-                                  char const **errstr)
+static void s3_disconnect (struct s3connection *conn)
 {
-  struct s3connection *ret;
-  unsigned int host, port;
-  int res;
+  if (conn->is_ssl != 0) {
+    /* gnutls' record state is stale once the kernel took over */
+    if (conn->ktls == 0)
+      gnutls_bye(conn->tls_sess, GNUTLS_SHUT_RDWR);
+    gnutls_deinit(conn->tls_sess);
+    gnutls_certificate_free_credentials(conn->tls_cred);
+    conn->is_ssl = 0;
+    conn->ktls = 0;
+  }
 
-  for (;;) {
-    *conn_num %= MAX(cfg->num_s3fetchers, cfg->num_s3hosts * cfg->num_s3ports);
+  close(conn->sock);
+  conn->sock = -1;
+}
+
+/* account for a finished request; on failure, eject endpoint for an
+   exponentially growing period (1s, 2s, 4s, ... 64s) */
+static void s3_endpoint_update (struct s3endpoint *ep, int failed,
+                                unsigned int latency_usec)
+{
+  if (pthread_mutex_lock(&ep->mtx) != 0)
+    return;
+
+  ep->requests++;
+
+  if (failed) {
+    ep->errors++;
+    ep->ejected_until = time(NULL) + (1 << MIN(ep->failures, 6));
+    ep->failures++;
+  } else {
+    ep->failures = 0;
+    ep->ejected_until = 0;
+
+    /* exponentially weighted moving average, alpha = 1/8 */
+    if (ep->ewma_usec == 0)
+      ep->ewma_usec = latency_usec;
+    else
+      ep->ewma_usec = ep->ewma_usec -
+                      ep->ewma_usec / 8 + latency_usec / 8;
+  }
+
+  pthread_mutex_unlock(&ep->mtx);
+}
+
+/* lower is better; unmeasured endpoints score 0, so they get probed */
+static unsigned long s3_endpoint_score (struct s3endpoint *ep, time_t now)
+{
+  if (ep->ejected_until > now)
+    return ULONG_MAX - (ep->ejected_until - now);
+
+  return (unsigned long) ep->ewma_usec * (ep->inflight + 1);
+}
+
+/* rand_r() state of s3_pick_endpoint(), seeded per thread on first use */
+static __thread unsigned int pick_seed;
+
+/* power of two choices: pick two endpoints at random, use the better one */
+static struct s3endpoint *s3_pick_endpoint (struct config *cfg)
+{
+  unsigned int *seed = &pick_seed;
+  struct s3endpoint *a, *b;
+  struct timespec ts;
+  time_t now;
+
+  if (*seed == 0) {
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    *seed = (ts.tv_sec ^ ts.tv_nsec ^ (uintptr_t) pthread_self()) | 1;
+  }
+
+  a = &cfg->s3endpoints[rand_r(seed) % cfg->num_s3endpoints];
+  if (cfg->num_s3endpoints == 1)
+    return a;
+
+  do {
+    b = &cfg->s3endpoints[rand_r(seed) % cfg->num_s3endpoints];
+  } while (b == a);
+
+  now = time(NULL);
+
+  /* now and then, use the second one regardless to refresh its latency */
+  if ((rand_r(seed) % 64 == 0) && (b->ejected_until <= now))
+    return b;
+
+  return (s3_endpoint_score(a, now) <= s3_endpoint_score(b, now) ? a : b);
+}
 
-    /* prefer different host over different port */
-    host = *conn_num % cfg->num_s3hosts;
-    port = (*conn_num / cfg->num_s3hosts) % cfg->num_s3ports;
+/* lock a free connection, preferably one that is already connected to the
+   given endpoint */
+static struct s3connection *s3_lock_conn (struct config *cfg,
+                                          struct s3endpoint *ep,
+                                          unsigned int *conn_num,
+                                          char const **errstr)
+{
+  struct s3connection *conn, *spare = NULL;
+  unsigned int i;
+  int res;
 
-    *conn_num += 1;
+  for (i = 0; i < cfg->num_s3conns; i++) {
+    *conn_num = (*conn_num + 1) % cfg->num_s3conns;
 
-    ret = &cfg->s3conns[*conn_num];
-    res = pthread_mutex_trylock(&ret->mtx);
+    conn = &cfg->s3conns[*conn_num];
+    res = pthread_mutex_trylock(&conn->mtx);
 
     if (res == EBUSY) continue;
     if (res != 0) {
       *errstr = strerror(res);
-      return NULL;
+      break;
+    }
+
+    if ((conn->sock >= 0) && (conn->endpoint == ep)) {
+      if (spare != NULL)
+        pthread_mutex_unlock(&spare->mtx);
+      return conn;
     }
 
-    ret->host = cfg->s3hosts[host];
-    ret->name = (cfg->s3name[0] == '\0' ? cfg->s3hosts[host] : cfg->s3name);
-    ret->port = cfg->s3ports[port];
-    ret->bucket = cfg->s3bucket;
-    ret->timeout = cfg->s3timeout;
+    if (spare == NULL)
+      spare = conn;
+    else
+      pthread_mutex_unlock(&conn->mtx);
+  }
+
+  return spare;
+}
+
+/* lock and, if necessary, connect a connection to the given endpoint;
+   returns 1 if there is no free connection or connecting failed */
+static int s3_try_conn (struct config *cfg, struct s3endpoint *ep,
+                        unsigned int *conn_num, struct s3connection **conn,
+                        char const **errstr)
+{
+  struct s3connection *ret;
 
-    if (ret->sock < 0) {
-      if (s3_connect(ret, errstr) != 0)
-        goto NEXT1;
+  *errstr = NULL;
 
-      if ((cfg->s3ssl != 0) && (s3_tls_setup(ret, errstr) != 0))
-        goto NEXT2;
+  ret = s3_lock_conn(cfg, ep, conn_num, errstr);
+  if (ret == NULL)
+    return (*errstr == NULL ? 1 : -1);
 
-      ret->remaining_reqs = cfg->s3_max_reqs_per_conn;
-    }
+  if ((ret->sock >= 0) && (ret->endpoint != ep))
+    s3_disconnect(ret);
 
-    ret->remaining_reqs--;
+  ret->endpoint = ep;
+  ret->host = ep->host;
+  ret->name = (cfg->s3name[0] == '\0' ? ep->host : cfg->s3name);
+  ret->port = ep->port;
+  ret->bucket = cfg->s3bucket;
+  ret->timeout = cfg->s3timeout;
 
-    return ret;
+  if (ret->sock < 0) {
+    if (s3_connect(cfg, ret, errstr) != 0)
+      goto ERROR;
+
+    if ((cfg->s3ssl != 0) && (s3_tls_setup(cfg, ret, errstr) != 0))
+      goto ERROR1;
+
+    ret->remaining_reqs = cfg->s3_max_reqs_per_conn;
+  }
 
-    NEXT2:
-      close(ret->sock);
+  ret->remaining_reqs--;
 
-    NEXT1:
-      pthread_mutex_unlock(&ret->mtx);
+  if (pthread_mutex_lock(&ep->mtx) == 0) {
+    ep->inflight++;
+    pthread_mutex_unlock(&ep->mtx);
   }
+
+  *conn = ret;
+
+  return 0;
+
+ERROR1:
+  close(ret->sock);
+  ret->sock = -1;
+
+ERROR:
+  s3_endpoint_update(ep, 1, 0);
+  pthread_mutex_unlock(&ret->mtx);
+
+  return 1;
 }
 
-void s3_release_conn (struct s3connection *conn)
+struct s3connection *s3_get_conn (struct config *cfg, unsigned int *conn_num,
+                                  char const **errstr)
 {
-  if ((conn->is_error != 0) || (conn->remaining_reqs == 0)) {
-    if (conn->is_ssl != 0) {
-      gnutls_bye(conn->tls_sess, GNUTLS_SHUT_RDWR);
-      gnutls_deinit(conn->tls_sess);
-      gnutls_certificate_free_credentials(conn->tls_cred);
-    }
+  struct s3connection *ret;
+  int res;
 
-    close(conn->sock);
-    conn->sock = -1;
+  for (;;) {
+    res = s3_try_conn(cfg, s3_pick_endpoint(cfg), conn_num, &ret,
+                      errstr);
+    if (res == 0)
+      return ret;
+    if (res < 0)
+      return NULL;
+  }
+}
+
+void s3_release_conn (struct s3connection *conn)
+{
+  if (pthread_mutex_lock(&conn->endpoint->mtx) == 0) {
+    conn->endpoint->inflight--;
+    pthread_mutex_unlock(&conn->endpoint->mtx);
   }
 
+  if ((conn->is_error != 0) || (conn->remaining_reqs == 0))
+    s3_disconnect(conn);
+
   pthread_mutex_unlock(&conn->mtx);
 }
 
+void s3_log_stats (struct config *cfg)
+{
+  struct s3endpoint *ep;
+  unsigned int i;
+  time_t now = time(NULL);
+
+  for (i = 0; i < cfg->num_s3endpoints; i++) {
+    ep = &cfg->s3endpoints[i];
+
+    if (pthread_mutex_lock(&ep->mtx) != 0)
+      continue;
+
+    syslog(LOG_INFO, "endpoint %s:%s: requests=%lu errors=%lu "
+           "latency=%u.%03ums inflight=%u ejected=%lis\n",
+           ep->host, ep->port, ep->requests, ep->errors,
+           ep->ewma_usec / 1000, ep->ewma_usec % 1000, ep->inflight,
+           (ep->ejected_until > now ? ep->ejected_until - now : 0));
+
+    pthread_mutex_unlock(&ep->mtx);
+  }
+
+  for (i = 0; i < cfg->num_devices; i++) {
+    syslog(LOG_INFO, "device %s: chunks=%lu raw=%lu dedup=%lu evicted=%lu "
+           "freed=%llu\n", cfg->devs[i].name, cfg->devs[i].chunks_coded,
+           cfg->devs[i].chunks_raw, cfg->devs[i].chunks_dedup,
+           cfg->devs[i].chunks_evicted, cfg->devs[i].bytes_evicted);
+  }
+}
+
 static int sha1_b64 (char *key, char *msg, char *b64, char const **errstr)
 {
   int res;
@@ -533,7 +1174,7 @@ static int s3_send_all (struct s3connection *conn, void *buffer,
   ssize_t res;
 
   for (written = 0; to_write > 0; written += res, to_write -= res) {
-    if (!conn->is_ssl) {
+    if (!conn->is_ssl || (conn->ktls & S3_KTLS_TX)) {
       if (s3_wait_for_socket(conn, WRITE, errstr) != 0)
         return -1;
 
@@ -558,10 +1199,86 @@ static int s3_send_all (struct s3connection *conn, void *buffer,
   return 0;
 }
 
-static ssize_t s3_recv (struct s3connection *conn, void *buffer, size_t buflen,
-                        char const **errstr)
+/* read application data from a kernel tls socket, skipping session
+   tickets. other post handshake messages, like a tls 1.3 key update,
+   would need gnutls' record state, which is stale once the kernel took
+   over; they fail the connection, so it gets reestablished */
+static ssize_t s3_ktls_recv (struct s3connection *conn, void *buffer,
+                             size_t buflen, char const **errstr)
 {
-  ssize_t ret;
+  char cbuf[CMSG_SPACE(sizeof(unsigned char))];
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  unsigned char *msgs = buffer, hdr[4];
+  size_t hdrlen = 0, skip = 0, len;
+  ssize_t ret, pos;
+
+  for (;;) {
+    if (s3_wait_for_socket(conn, READ, errstr) != 0)
+      return -1;
+
+    iov.iov_base = buffer;
+    iov.iov_len = buflen;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    ret = recvmsg(conn->sock, &msg, 0);
+    if (ret < 0) {
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+        continue;
+      *errstr = strerror(errno);
+      return -1;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if ((cmsg == NULL) || (cmsg->cmsg_level != SOL_TLS) ||
+        (cmsg->cmsg_type != TLS_GET_RECORD_TYPE) ||
+        (*CMSG_DATA(cmsg) == TLS_RECORD_DATA)) {
+      if ((hdrlen > 0) || (skip > 0)) {
+        *errstr = "truncated tls handshake message";
+        return -1;
+      }
+      return ret;
+    }
+
+    if (*CMSG_DATA(cmsg) != TLS_RECORD_HANDSHAKE) {
+      *errstr = "unexpected tls record";
+      return -1;
+    }
+
+    /* handshake messages, 1 byte type, 3 bytes length and the body, may
+       span records, and records may take several reads */
+    for (pos = 0; pos < ret; pos += len) {
+      if (skip > 0) {
+        len = MIN(skip, (size_t) (ret - pos));
+        skip -= len;
+        continue;
+      }
+
+      len = 1;
+      hdr[hdrlen++] = msgs[pos];
+      if (hdrlen < sizeof(hdr))
+        continue;
+
+      if (hdr[0] != GNUTLS_HANDSHAKE_NEW_SESSION_TICKET) {
+        *errstr = "unexpected tls handshake message";
+        return -1;
+      }
+
+      skip = (hdr[1] << 16) | (hdr[2] << 8) | hdr[3];
+      hdrlen = 0;
+    }
+  }
+}
+
+static ssize_t s3_recv (struct s3connection *conn, void *buffer, size_t buflen,
+                        char const **errstr)
+{
+  ssize_t ret;
 
   if (!conn->is_ssl) {
     if (s3_wait_for_socket(conn, READ, errstr) != 0)
@@ -573,6 +1290,9 @@ static ssize_t s3_recv (struct s3connection *conn, void *buffer, size_t buflen,
       *errstr = strerror(errno);
       return -1;
     }
+  } else if (conn->ktls & S3_KTLS_RX) {
+    if ((ret = s3_ktls_recv(conn, buffer, buflen, errstr)) < 0)
+      return -1;
   } else for (;;) {
     ret = gnutls_record_recv(conn->tls_sess, buffer, buflen);
     if (ret >= 0)
@@ -603,20 +1323,202 @@ static const char *httpverb_to_string (enum httpverb verb)
   }
 }
 
+static int sha256_hex (void *data, size_t len, char *hex, char const **errstr)
+{
+  unsigned char digest[32];
+  int res;
+
+  res = gnutls_hash_fast(GNUTLS_DIG_SHA256, data, len, digest);
+  if (res != GNUTLS_E_SUCCESS) {
+    *errstr = gnutls_strerror(res);
+    return -1;
+  }
+
+  base16_encode_update(hex, sizeof(digest), digest);
+  hex[BASE16_ENCODE_LENGTH(sizeof(digest))] = '\0';
+
+  return 0;
+}
+
+static int hmac_sha256 (void *key, size_t keylen, char *msg,
+                        unsigned char *digest, char const **errstr)
+{
+  int res;
+
+  res = gnutls_hmac_fast(GNUTLS_MAC_SHA256, key, keylen, msg, strlen(msg),
+                         digest);
+  if (res != GNUTLS_E_SUCCESS) {
+    *errstr = gnutls_strerror(res);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* get signing key for given date (YYYYMMDD), derive it only once per day */
+static int s3_sigv4_key (struct config *cfg, char *date, unsigned char *key,
+                         char const **errstr)
+{
+  struct s3sigkey *sk = &cfg->s3sigkey;
+  char secret[sizeof(cfg->s3secretkey) + 4];
+  int res, result = -1;
+
+  if ((res = pthread_mutex_lock(&sk->mtx)) != 0) {
+    *errstr = strerror(res);
+    return -1;
+  }
+
+  if (strcmp(sk->date, date) != 0) {
+    snprintf(secret, sizeof(secret), "AWS4%s", cfg->s3secretkey);
+    sk->date[0] = '\0';
+
+    if ((hmac_sha256(secret, strlen(secret), date, sk->key, errstr) != 0) ||
+        (hmac_sha256(sk->key, 32, cfg->s3region, sk->key, errstr) != 0) ||
+        (hmac_sha256(sk->key, 32, "s3", sk->key, errstr) != 0) ||
+        (hmac_sha256(sk->key, 32, "aws4_request", sk->key, errstr) != 0))
+      goto ERROR;
+
+    /* YYYYMMDD */
+    memcpy(sk->date, date, sizeof(sk->date) - 1);
+    sk->date[sizeof(sk->date) - 1] = '\0';
+  }
+
+  memcpy(key, sk->key, sizeof(sk->key));
+  result = 0;
+
+ERROR:
+  if ((res = pthread_mutex_unlock(&sk->mtx)) != 0) {
+    *errstr = strerror(res);
+    result = -1;
+  }
+
+  return result;
+}
+
+/* AWS signature v2: HMAC-SHA1 over verb, md5, date and path */
+static int s3_sign_v2 (struct config *cfg, struct s3connection *conn,
+                       enum httpverb verb, char *path, char *md5b64,
+                       struct tm *tm, char *header, size_t headerlen,
+                       char const **errstr)
+{
+  char date[32], string_to_sign[1024];
+
+  strftime(date, sizeof(date) - 1, "%a, %d %b %Y %T GMT", tm);
+
+  snprintf(string_to_sign, sizeof(string_to_sign) - 1,
+           "%s\n" // http verb
+           "%s\n" // content md5
+           "\n"   // content type
+           "%s\n" // date
+           "%s",  // path
+           httpverb_to_string(verb), md5b64, date, path);
+
+  snprintf(header, headerlen - 1,
+           "%s %s HTTP/1.1\r\n"
+           "Host: %s\r\n"
+           "Date: %s\r\n"
+           "User-Agent: s3blkdev\r\n"
+           "Authorization: AWS %s:",
+           httpverb_to_string(verb), path, conn->name, date,
+           cfg->s3accesskey);
+
+  return sha1_b64(cfg->s3secretkey, string_to_sign, header + strlen(header),
+                  errstr);
+}
+
+/* AWS signature v4: HMAC-SHA256 over hashed canonical request, signed with
+   the cached key of the day; PUT over TLS uses an unsigned payload, so the
+   body is not hashed twice */
+static int s3_sign_v4 (struct config *cfg, struct s3connection *conn,
+                       enum httpverb verb, char *path, char *md5b64,
+                       void *data, size_t data_len, struct tm *tm,
+                       char *header, size_t headerlen, char const **errstr)
+{
+  char amzdate[20], scope[128], payload_hash[65], canonical[1024],
+       string_to_sign[512], signature[65], *signed_headers;
+  unsigned char key[32], digest[32];
+
+  strftime(amzdate, sizeof(amzdate), "%Y%m%dT%H%M%SZ", tm);
+  amzdate[8] = '\0';
+
+  if (s3_sigv4_key(cfg, amzdate, key, errstr) != 0)
+    return -1;
+
+  snprintf(scope, sizeof(scope), "%s/%s/s3/aws4_request", amzdate,
+           cfg->s3region);
+  amzdate[8] = 'T';
+
+  if (verb != PUT)
+    strcpy(payload_hash, S3_EMPTY_SHA256);
+  else if (conn->is_ssl)
+    strcpy(payload_hash, "UNSIGNED-PAYLOAD");
+  else if (sha256_hex(data, data_len, payload_hash, errstr) != 0)
+    return -1;
+
+  signed_headers = (verb == PUT ? "content-md5;host;x-amz-content-sha256;"
+                                  "x-amz-date"
+                                : "host;x-amz-content-sha256;x-amz-date");
+
+  snprintf(canonical, sizeof(canonical) - 1,
+           "%s\n"  // http verb
+           "%s\n"  // path
+           "\n"    // query string
+           "%s%s%s"
+           "host:%s\n"
+           "x-amz-content-sha256:%s\n"
+           "x-amz-date:%s\n"
+           "\n"
+           "%s\n"  // signed headers
+           "%s",   // payload hash
+           httpverb_to_string(verb), path,
+           (verb == PUT ? "content-md5:" : ""), md5b64,
+           (verb == PUT ? "\n" : ""), conn->name, payload_hash, amzdate,
+           signed_headers, payload_hash);
+
+  strcpy(string_to_sign, "AWS4-HMAC-SHA256\n");
+  strcat(string_to_sign, amzdate);
+  strcat(string_to_sign, "\n");
+  strcat(string_to_sign, scope);
+  strcat(string_to_sign, "\n");
+
+  if (sha256_hex(canonical, strlen(canonical),
+                 string_to_sign + strlen(string_to_sign), errstr) != 0)
+    return -1;
+
+  if (hmac_sha256(key, sizeof(key), string_to_sign, digest, errstr) != 0)
+    return -1;
+
+  base16_encode_update(signature, sizeof(digest), digest);
+  signature[BASE16_ENCODE_LENGTH(sizeof(digest))] = '\0';
+
+  snprintf(header, headerlen - 1,
+           "%s %s HTTP/1.1\r\n"
+           "Host: %s\r\n"
+           "x-amz-date: %s\r\n"
+           "x-amz-content-sha256: %s\r\n"
+           "User-Agent: s3blkdev\r\n"
+           "Authorization: AWS4-HMAC-SHA256 Credential=%s/%s, "
+           "SignedHeaders=%s, Signature=%s",
+           httpverb_to_string(verb), path, conn->name, amzdate, payload_hash,
+           cfg->s3accesskey, scope, signed_headers, signature);
+
+  return 0;
+}
+
 static int s3_start_req (struct config *cfg, struct s3connection *conn,
                          enum httpverb verb, char *folder, char *filename,
                          void *data, size_t data_len, void *data_md5,
+                         size_t range_start, size_t range_len,
                          char const **errstr)
 {
   time_t now;
   struct tm tm;
-  int url_start, res;
-  char date[32], string_to_sign[512], header[1024];
+  int res;
+  char path[512], header[2048];
   unsigned char md5b64[BASE64_ENCODE_RAW_LENGTH(16) + 1];
 
   time(&now);
   gmtime_r(&now, &tm);
-  strftime(date, sizeof(date) - 1, "%a, %d %b %Y %T GMT", &tm);
 
   if (verb == PUT) {
     base64_encode_raw(md5b64, 16, data_md5);
@@ -624,26 +1526,14 @@ static int s3_start_req (struct config *cfg, struct s3connection *conn,
   } else
     md5b64[0] = '\0';
 
-  snprintf(string_to_sign, sizeof(string_to_sign) - 1,
-           "%s\n" // http verb
-           "%s\n" // content md5
-           "\n"   // content type
-           "%s\n" // date
-           "%n/%s/%s/%s",
-           httpverb_to_string(verb), md5b64, date, &url_start, cfg->s3bucket,
-           folder, filename);
+  snprintf(path, sizeof(path), "/%s/%s/%s", cfg->s3bucket, folder, filename);
 
-  snprintf(header, sizeof(header) - 1,
-           "%s %s HTTP/1.1\r\n"
-           "Host: %s\r\n"
-           "Date: %s\r\n"
-           "User-Agent: s3blkdev\r\n"
-           "Authorization: AWS %s:",
-           httpverb_to_string(verb), string_to_sign + url_start, conn->name,
-           date, cfg->s3accesskey);
-
-  res = sha1_b64(cfg->s3secretkey, string_to_sign, header + strlen(header),
-                 errstr);
+  if (cfg->s3sigv4)
+    res = s3_sign_v4(cfg, conn, verb, path, (char *) md5b64, data, data_len,
+                     &tm, header, sizeof(header), errstr);
+  else
+    res = s3_sign_v2(cfg, conn, verb, path, (char *) md5b64, &tm, header,
+                     sizeof(header), errstr);
   if (res != 0)
     return -1;
 
@@ -654,6 +1544,12 @@ static int s3_start_req (struct config *cfg, struct s3connection *conn,
              "Content-MD5: %s",
              data_len, md5b64);
 
+  if (range_len > 0)
+    snprintf(header + strlen(header), sizeof(header) - strlen(header) - 1,
+             "\r\n"
+             "Range: bytes=%lu-%lu",
+             range_start, range_start + range_len - 1);
+
   strcat(header, "\r\n\r\n");
 
   if (s3_send_all(conn, header, strlen(header), errstr) != 0)
@@ -699,7 +1595,8 @@ static int s3_scan_etag (char *option, unsigned char *md5, const char **errstr)
 static int s3_finish_req (struct s3connection *conn, enum httpverb verb,
                           unsigned short *code, size_t *contentlen,
                           unsigned char *md5, char *buffer,
-                          size_t buflen, char const **errstr)
+                          size_t buflen, struct timespec *sent,
+                          char const **errstr)
 {
   char header[1024];
   ssize_t res;
@@ -728,6 +1625,9 @@ static int s3_finish_req (struct s3connection *conn, enum httpverb verb,
 
   body += 4;
 
+  /* time to first byte, excluding upload time of PUT */
+  conn->ttfb_usec = usec_since(sent);
+
   if (sscanf(header, "HTTP/1.1 %hu", code) != 1) {
     *errstr = "no HTTP/1.1 response code";
     return -1;
@@ -746,6 +1646,16 @@ static int s3_finish_req (struct s3connection *conn, enum httpverb verb,
     return -1;
   }
 
+  /* size of whole object if only a range of it was requested */
+  conn->objlen = *contentlen;
+  if ((*code == 206) &&
+      (((option = strstr(header, "Content-Range")) == NULL) ||
+       (sscanf(option, "Content-Range: bytes %*u-%*u/%lu", &conn->objlen)
+        != 1))) {
+    *errstr = "no or invalid Content-Range";
+    return -1;
+  }
+
   /* etag is content md5 */
   if (((option = strstr(header, "ETag")) != NULL) &&
       (s3_scan_etag(option, md5, errstr) != 0))
@@ -777,21 +1687,564 @@ int s3_request (struct config *cfg, struct s3connection *conn,
                 unsigned short *code, size_t *contentlen, unsigned char *md5,
                 char *buffer, size_t buflen)
 {
+  struct timespec sent;
   int res;
 
   conn->is_error = 1;
 
   res = s3_start_req(cfg, conn, verb, folder, filename, data, data_len,
-                     data_md5, errstr);
+                     data_md5, 0, 0, errstr);
   if (res != 0)
-    return -1;
+    goto ERROR;
+
+  clock_gettime(CLOCK_MONOTONIC, &sent);
 
   res = s3_finish_req(conn, verb, code, contentlen, md5, buffer, buflen,
-                      errstr);
+                      &sent, errstr);
   if (res != 0)
-    return -1;
+    goto ERROR;
 
   conn->is_error = (*code != 200);
 
+  /* 404 is a regular answer, 5xx (e.g. 503 SlowDown) is not */
+  s3_endpoint_update(conn->endpoint, (*code >= 500), conn->ttfb_usec);
+
+  return 0;
+
+ERROR:
+  s3_endpoint_update(conn->endpoint, 1, 0);
+  return -1;
+}
+
+/* map time to first byte to a histogram bucket, 4 buckets per power of 2 */
+static unsigned int s3_hedge_bucket (unsigned int usec)
+{
+  unsigned int msb;
+
+  if (usec < 4)
+    return usec;
+
+  msb = 31 - __builtin_clz(usec);
+
+  return 4 * (msb - 1) + ((usec >> (msb - 2)) & 3);
+}
+
+/* upper bound of a histogram bucket in usec; those of the last buckets
+   exceed 32 bits */
+static uint64_t s3_hedge_bucket_usec (unsigned int bucket)
+{
+  if (bucket < 4)
+    return bucket + 1;
+
+  return (uint64_t) (5 + bucket % 4) << (bucket / 4 - 1);
+}
+
+/* count a GET and decide after how many usec without an answer it should be
+   hedged, at most after s3timeout; 0 means no hedging, because it is
+   disabled, there are not enough samples yet, or the extra load budget is
+   used up */
+static unsigned int s3_hedge_delay (struct config *cfg)
+{
+  struct s3hedge *h = &cfg->s3hedge;
+  unsigned int i, sum, target, delay = 0;
+
+  if (cfg->s3hedgepct == 0)
+    return 0;
+
+  if (pthread_mutex_lock(&h->mtx) != 0)
+    return 0;
+
+  h->gets++;
+
+  if ((h->samples >= 100) &&
+      (h->hedged * 100 < h->gets * cfg->s3hedgebudget)) {
+    target = h->samples * cfg->s3hedgepct / 100;
+
+    for (i = 0, sum = 0; i < S3_HEDGE_BUCKETS; i++) {
+      sum += h->buckets[i];
+      if (sum > target)
+        break;
+    }
+
+    if (i < S3_HEDGE_BUCKETS)
+      delay = MIN(s3_hedge_bucket_usec(i), (uint64_t) cfg->s3timeout * 1000);
+  }
+
+  pthread_mutex_unlock(&h->mtx);
+
+  return delay;
+}
+
+/* count a hedged GET about to be sent, unless that would exceed the extra
+   load budget. counting it when sent rather than when answered keeps GETs
+   slow at the same time from all passing the check */
+static int s3_hedge_reserve (struct config *cfg)
+{
+  struct s3hedge *h = &cfg->s3hedge;
+  int ok;
+
+  if (pthread_mutex_lock(&h->mtx) != 0)
+    return 0;
+
+  ok = (h->hedged * 100 < h->gets * cfg->s3hedgebudget);
+  h->hedged += ok;
+
+  pthread_mutex_unlock(&h->mtx);
+
+  return ok;
+}
+
+/* record time to first byte of a GET; old samples fade out by halving all
+   counters from time to time */
+static void s3_hedge_record (struct config *cfg, unsigned int usec)
+{
+  struct s3hedge *h = &cfg->s3hedge;
+  unsigned int i;
+
+  if (cfg->s3hedgepct == 0)
+    return;
+
+  if (pthread_mutex_lock(&h->mtx) != 0)
+    return;
+
+  if (h->samples >= 10000) {
+    /* halving rounds each bucket down, so samples is what remains */
+    for (i = 0, h->samples = 0; i < S3_HEDGE_BUCKETS; i++) {
+      h->buckets[i] /= 2;
+      h->samples += h->buckets[i];
+    }
+
+    h->gets /= 2;
+    h->hedged /= 2;
+  }
+
+  h->buckets[s3_hedge_bucket(usec)]++;
+  h->samples++;
+
+  pthread_mutex_unlock(&h->mtx);
+}
+
+/* get a free connection for a hedged request, preferably to another endpoint
+   than the first request; never waits for a connection to become free */
+static struct s3connection *s3_get_hedge_conn (struct config *cfg,
+                                               struct s3endpoint *exclude,
+                                               unsigned int *conn_num)
+{
+  struct s3connection *ret;
+  struct s3endpoint *ep = exclude;
+  unsigned long score, best = ULONG_MAX;
+  time_t now = time(NULL);
+  unsigned int i;
+  const char *errstr;
+
+  for (i = 0; i < cfg->num_s3endpoints; i++) {
+    if (&cfg->s3endpoints[i] == exclude)
+      continue;
+
+    score = s3_endpoint_score(&cfg->s3endpoints[i], now);
+    if (score < best) {
+      best = score;
+      ep = &cfg->s3endpoints[i];
+    }
+  }
+
+  if (s3_try_conn(cfg, ep, conn_num, &ret, &errstr) != 0)
+    return NULL;
+
+  return ret;
+}
+
+/* wait until the first of the given connections becomes readable; returns
+   its index, -1 on timeout and -2 on error */
+static int s3_wait_any (struct s3connection **conns, int num_conns,
+                        unsigned int timeout_usec, char const **errstr)
+{
+  fd_set fds;
+  struct timeval timeout;
+  int i, maxfd = -1, res;
+
+  FD_ZERO(&fds);
+
+  for (i = 0; i < num_conns; i++) {
+    if (conns[i]->is_ssl && (gnutls_record_check_pending(conns[i]->tls_sess)))
+      return i;
+
+    FD_SET(conns[i]->sock, &fds);
+    maxfd = MAX(maxfd, conns[i]->sock);
+  }
+
+  timeout.tv_sec = timeout_usec / 1000000;
+  timeout.tv_usec = timeout_usec % 1000000;
+
+  res = select(maxfd + 1, &fds, NULL, NULL, &timeout);
+  if (res < 0) {
+    *errstr = strerror(errno);
+    return -2;
+  }
+
+  for (i = 0; i < num_conns; i++)
+    if (FD_ISSET(conns[i]->sock, &fds))
+      return i;
+
+  return -1;
+}
+
+/* GET an object; if configured, and no answer arrived within the s3hedgepct
+   percentile of recent times to first byte, send the same GET over a second
+   connection and use whichever answers first */
+int s3_get (struct config *cfg, unsigned int *conn_num, char const **errstr,
+            char *folder, char *filename, unsigned short *code,
+            size_t *contentlen, unsigned char *md5, char *buffer,
+            size_t buflen)
+{
+  struct s3connection *conns[2];
+  struct timespec sent[2];
+  unsigned int delay;
+  int num_conns = 1, winner = 0, i, res;
+
+  conns[0] = s3_get_conn(cfg, conn_num, errstr);
+  if (conns[0] == NULL)
+    return -1;
+
+  conns[0]->is_error = 1;
+
+  res = s3_start_req(cfg, conns[0], GET, folder, filename, NULL, 0, NULL,
+                     0, 0, errstr);
+  if (res != 0)
+    goto ERROR;
+
+  clock_gettime(CLOCK_MONOTONIC, &sent[0]);
+
+  if ((delay = s3_hedge_delay(cfg)) > 0) {
+    res = s3_wait_any(conns, 1, delay, errstr);
+    if (res < -1)
+      goto ERROR;
+
+    if ((res == -1) &&
+        ((conns[1] = s3_get_hedge_conn(cfg, conns[0]->endpoint,
+                                       conn_num)) != NULL)) {
+      if (!s3_hedge_reserve(cfg)) {
+        s3_release_conn(conns[1]);
+      } else {
+        conns[1]->is_error = 1;
+
+        res = s3_start_req(cfg, conns[1], GET, folder, filename, NULL, 0,
+                           NULL, 0, 0, errstr);
+        if (res == 0) {
+          clock_gettime(CLOCK_MONOTONIC, &sent[1]);
+          num_conns = 2;
+
+          /* on timeout, let the first request run into it as well */
+          winner = MAX(0, s3_wait_any(conns, 2, cfg->s3timeout * 1000,
+                                      errstr));
+        } else {
+          s3_endpoint_update(conns[1]->endpoint, 1, 0);
+          s3_release_conn(conns[1]);
+        }
+      }
+    }
+  }
+
+  res = s3_finish_req(conns[winner], GET, code, contentlen, md5, buffer,
+                      buflen, &sent[winner], errstr);
+  if (res != 0)
+    goto ERROR;
+
+  conns[winner]->is_error = (*code != 200);
+
+  s3_endpoint_update(conns[winner]->endpoint, (*code >= 500),
+                     conns[winner]->ttfb_usec);
+
+  if (*code < 500)
+    s3_hedge_record(cfg, conns[winner]->ttfb_usec + (winner == 1 ? delay : 0));
+
+  if (num_conns == 2) {
+    /* loser keeps is_error set, its answer is still on the wire */
+    s3_endpoint_update(conns[1 - winner]->endpoint, 0,
+                       usec_since(&sent[1 - winner]));
+    s3_release_conn(conns[1 - winner]);
+  }
+
+  s3_release_conn(conns[winner]);
+
   return 0;
+
+ERROR:
+  s3_endpoint_update(conns[winner]->endpoint, 1, 0);
+
+  for (i = 0; i < num_conns; i++)
+    s3_release_conn(conns[i]);
+
+  return -1;
+}
+
+struct s3part {
+  struct config *cfg;
+  char *folder;
+  char *filename;
+  char *buffer;
+  size_t buflen; // the whole object fits, should the range be ignored
+  size_t start;
+  size_t len;
+  size_t contentlen;
+  size_t objlen;
+  unsigned int conn_num;
+  unsigned short code;
+  unsigned char md5[16];
+  char const *errstr;
+  int result;
+};
+
+/* GET a byte range of an object into part->buffer */
+static void *s3_get_part (void *arg0)
+{
+  struct s3part *part = (struct s3part*) arg0;
+  struct s3connection *conn;
+  struct timespec sent;
+
+  part->result = -1;
+
+  conn = s3_get_conn(part->cfg, &part->conn_num, &part->errstr);
+  if (conn == NULL)
+    return NULL;
+
+  conn->is_error = 1;
+
+  if (s3_start_req(part->cfg, conn, GET, part->folder, part->filename, NULL,
+                   0, NULL, part->start, part->len, &part->errstr) != 0)
+    goto ERROR;
+
+  clock_gettime(CLOCK_MONOTONIC, &sent);
+
+  if (s3_finish_req(conn, GET, &part->code, &part->contentlen, part->md5,
+                    part->buffer, part->buflen, &sent, &part->errstr) != 0)
+    goto ERROR;
+
+  conn->is_error = ((part->code != 200) && (part->code != 206));
+  s3_endpoint_update(conn->endpoint, (part->code >= 500), conn->ttfb_usec);
+
+  part->objlen = conn->objlen;
+  part->result = 0;
+
+  s3_release_conn(conn);
+  return NULL;
+
+ERROR:
+  s3_endpoint_update(conn->endpoint, 1, 0);
+  s3_release_conn(conn);
+  return NULL;
+}
+
+/* the ranges of one s3_get_parts() call past the first, fetched by the
+   caller and the pool */
+struct s3parts_job {
+  struct s3part *parts;
+  unsigned int num_parts;
+  unsigned int next_part;
+  unsigned int done_parts;
+  struct s3parts_job *next;
+};
+
+static struct {
+  pthread_mutex_t mtx;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  struct s3parts_job *jobs;
+} parts_pool = {
+  PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+  PTHREAD_COND_INITIALIZER, NULL
+};
+
+static void *s3_parts_worker (void *arg __attribute__((unused)))
+{
+  struct s3parts_job *job;
+  unsigned int i;
+
+  pthread_mutex_lock(&parts_pool.mtx);
+
+  for (;;) {
+    for (job = parts_pool.jobs; job != NULL; job = job->next) {
+      if (job->next_part < job->num_parts)
+        break;
+    }
+
+    if (job == NULL) {
+      pthread_cond_wait(&parts_pool.work, &parts_pool.mtx);
+      continue;
+    }
+
+    i = job->next_part++;
+    pthread_mutex_unlock(&parts_pool.mtx);
+
+    s3_get_part(&job->parts[i]);
+
+    pthread_mutex_lock(&parts_pool.mtx);
+    if (++job->done_parts == job->num_parts)
+      pthread_cond_broadcast(&parts_pool.done);
+  }
+
+  return NULL;
+}
+
+/* hand out the ranges of a job to the pool, fetch them as well, and wait
+   until all are done */
+static void s3_parts_run (struct s3parts_job *job)
+{
+  struct s3parts_job **pjob;
+  unsigned int i;
+
+  job->next_part = job->done_parts = 0;
+
+  pthread_mutex_lock(&parts_pool.mtx);
+
+  job->next = parts_pool.jobs;
+  parts_pool.jobs = job;
+  if (job->num_parts > 1)
+    pthread_cond_broadcast(&parts_pool.work);
+
+  while (job->next_part < job->num_parts) {
+    i = job->next_part++;
+    pthread_mutex_unlock(&parts_pool.mtx);
+
+    s3_get_part(&job->parts[i]);
+
+    pthread_mutex_lock(&parts_pool.mtx);
+    job->done_parts++;
+  }
+
+  while (job->done_parts < job->num_parts)
+    pthread_cond_wait(&parts_pool.done, &parts_pool.mtx);
+
+  for (pjob = &parts_pool.jobs; *pjob != job; pjob = &(*pjob)->next);
+  *pjob = job->next;
+
+  pthread_mutex_unlock(&parts_pool.mtx);
+}
+
+/* each fetcher fetches one of the remaining ranges itself */
+int s3_start_parts_workers (struct config *cfg, char const **errstr)
+{
+  pthread_t thread;
+  pthread_attr_t thread_attr;
+  unsigned int i;
+  int res;
+
+  if (cfg->s3rangeparts <= 2)
+    return 0;
+
+  if ((res = pthread_attr_init(&thread_attr)) != 0)
+    goto ERROR;
+
+  res = pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+  if (res != 0)
+    goto ERROR1;
+
+  for (i = 0; i < cfg->num_s3fetchers * (cfg->s3rangeparts - 2u); i++) {
+    res = pthread_create(&thread, &thread_attr, &s3_parts_worker, NULL);
+    if (res != 0)
+      goto ERROR1;
+  }
+
+  pthread_attr_destroy(&thread_attr);
+
+  return 0;
+
+ERROR1:
+  pthread_attr_destroy(&thread_attr);
+
+ERROR:
+  *errstr = strerror(res);
+
+  return -1;
+}
+
+/* GET an object as up to s3rangeparts byte ranges over several connections
+   in parallel; the first range tells the size of the object, then the rest
+   is fetched by the caller and the threads of s3_start_parts_workers(). a
+   server ignoring the range sends the whole object right away */
+int s3_get_parts (struct config *cfg, unsigned int *conn_num,
+                  char const **errstr, char *folder, char *filename,
+                  unsigned short *code, size_t *contentlen,
+                  unsigned char *md5, char *buffer, size_t buflen)
+{
+  struct s3part parts[S3_MAX_PARTS];
+  struct s3parts_job job;
+  size_t partlen, offs;
+  unsigned int num_parts, i;
+  int result = -1;
+
+  memset(parts, 0, sizeof(parts));
+
+  for (i = 0; i < cfg->s3rangeparts; i++) {
+    parts[i].cfg = cfg;
+    parts[i].folder = folder;
+    parts[i].filename = filename;
+    parts[i].conn_num = *conn_num + i;
+  }
+
+  parts[0].buffer = buffer;
+  parts[0].buflen = buflen;
+  parts[0].len = buflen / cfg->s3rangeparts;
+
+  s3_get_part(&parts[0]);
+  *conn_num = parts[0].conn_num;
+
+  if (parts[0].result != 0) {
+    *errstr = parts[0].errstr;
+    return -1;
+  }
+
+  *code = parts[0].code;
+  *contentlen = parts[0].contentlen;
+  memcpy(md5, parts[0].md5, sizeof(parts[0].md5));
+
+  /* not found, server ignored the range, or object fit into first range */
+  if ((*code != 206) || (parts[0].objlen <= *contentlen)) {
+    if (*code == 206)
+      *code = 200;
+    return 0;
+  }
+
+  if (parts[0].objlen > buflen) {
+    *errstr = "Content-Length too large";
+    return -1;
+  }
+
+  offs = *contentlen;
+  partlen = (parts[0].objlen - offs + cfg->s3rangeparts - 2) /
+            (cfg->s3rangeparts - 1);
+
+  for (num_parts = 1; offs < parts[0].objlen; num_parts++, offs += partlen) {
+    parts[num_parts].buffer = buffer + offs;
+    parts[num_parts].start = offs;
+    parts[num_parts].len = MIN(partlen, parts[0].objlen - offs);
+    parts[num_parts].buflen = parts[num_parts].len;
+  }
+
+  job.parts = &parts[1];
+  job.num_parts = num_parts - 1;
+  s3_parts_run(&job);
+
+  result = 0;
+
+  for (i = 1; i < num_parts; i++) {
+    if (parts[i].result != 0) {
+      *errstr = parts[i].errstr;
+      result = -1;
+      break;
+    } else if ((parts[i].code != 206) ||
+               (parts[i].contentlen != parts[i].len) ||
+               (parts[i].objlen != parts[0].objlen) ||
+               (memcmp(parts[i].md5, md5, sizeof(parts[i].md5)) != 0)) {
+      /* object changed in between, or some range failed */
+      *errstr = "ranged GET returned inconsistent parts";
+      result = -1;
+      break;
+    }
+  }
+
+  *code = 200;
+  *contentlen = parts[0].objlen;
+
+  return result;
 }
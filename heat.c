@@ -0,0 +1,190 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "s3blkdev.h"
+
+/* the heat map of a device is a snapshot of the access statistics the
+   chunk map keeps of the chunks in the cache, hottest first. chunks used
+   since the oldest one the cache keeps stay in it while missing, so a
+   warm-up cut short loses none. s3blkdevd saves it to the device's
+   heatfile now and then and when it exits. the heatfile may live outside
+   cachedir, so it outlasts a lost or replaced cache, and may be taken
+   along to another host. on its next start, s3blkdevd carries the
+   statistics over into the chunk map and fetches the chunks of the heat
+   map that are missing from the cache */
+
+/* qsort() callback, hottest first: chunks used repeatedly, then chunks
+   used once, each by descending access time. that is the reverse of the
+   order s3blkdev-sync evicts chunks in */
+static int compare_heat (const void *a0, const void *b0)
+{
+  const struct heat_entry *a = a0, *b = b0;
+
+  if ((a->refs >= 2) != (b->refs >= 2))
+    return (a->refs >= 2 ? -1 : 1);
+
+  return (a->atime < b->atime) - (a->atime > b->atime);
+}
+
+int heat_save (struct device *dev, char const **errstr)
+{
+  struct chunkmap *map = dev->chunkmap;
+  struct chunkmap_entry *entry;
+  struct heat_entry *entries;
+  struct heat_header hdr;
+  char tmppath[PATH_MAX];
+  uint64_t i, n;
+  FILE *fh;
+
+  if ((map == NULL) || (dev->heatfile[0] == '\0'))
+    return 0;
+
+  entries = malloc(sizeof(entries[0]) * MAX(map->num_chunks, 1));
+  if (entries == NULL) {
+    *errstr = "malloc() failed";
+    return -1;
+  }
+
+  for (i = n = 0; i < map->num_chunks; i++) {
+    entry = &map->entries[i];
+    if (!(entry->flags & CHUNK_CACHED) &&
+        ((entry->atime == 0) || (entry->atime < map->horizon)))
+      continue;
+
+    entries[n].chunk_no = i;
+    entries[n].atime = entry->atime;
+    entries[n].refs = entry->refs;
+    n++;
+  }
+
+  qsort(entries, n, sizeof(entries[0]), compare_heat);
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = HEAT_MAGIC;
+  hdr.version = HEAT_VERSION;
+  hdr.num_chunks = map->num_chunks;
+  hdr.num_entries = n;
+
+  if (snprintf(tmppath, sizeof(tmppath), "%s.tmp",
+               dev->heatfile) >= (int) sizeof(tmppath)) {
+    errno = ENAMETOOLONG;
+    goto ERROR;
+  }
+
+  if ((fh = fopen(tmppath, "w")) == NULL)
+    goto ERROR;
+
+  if ((fwrite(&hdr, sizeof(hdr), 1, fh) != 1) ||
+      (fwrite(entries, sizeof(entries[0]), n, fh) != n) ||
+      (fflush(fh) != 0) || (fsync(fileno(fh)) != 0))
+    goto ERROR1;
+
+  if ((fclose(fh) != 0) || (rename(tmppath, dev->heatfile) != 0)) {
+    *errstr = strerror(errno);
+    unlink(tmppath);
+    free(entries);
+    return -1;
+  }
+
+  free(entries);
+
+  return 0;
+
+ERROR1:
+  *errstr = strerror(errno);
+  fclose(fh);
+  unlink(tmppath);
+  free(entries);
+  return -1;
+
+ERROR:
+  *errstr = strerror(errno);
+  free(entries);
+  return -1;
+}
+
+/* hand the statistics of the heat map to the chunks the chunk map knows
+   less recent ones of, e.g. all of them if it is new, and list the chunks
+   of the heat map missing from the cache, hottest first. chunks used
+   before what the cache keeps are left out, they have been evicted since.
+   a missing heatfile is an empty one */
+int heat_restore (struct device *dev, struct heat_entry **missing,
+                  size_t *num_missing, char const **errstr)
+{
+  struct chunkmap *map = dev->chunkmap;
+  struct chunkmap_entry *entry;
+  struct heat_header hdr;
+  struct heat_entry e;
+  uint64_t i, size;
+  FILE *fh;
+
+  *missing = NULL;
+  *num_missing = 0;
+
+  if ((map == NULL) || (dev->heatfile[0] == '\0'))
+    return 0;
+
+  if ((fh = fopen(dev->heatfile, "r")) == NULL) {
+    if (errno == ENOENT)
+      return 0;
+    *errstr = strerror(errno);
+    return -1;
+  }
+
+  if (fread(&hdr, sizeof(hdr), 1, fh) != 1)
+    goto ERROR;
+
+  if ((hdr.magic != HEAT_MAGIC) || (hdr.version != HEAT_VERSION) ||
+      (hdr.num_entries > hdr.num_chunks)) {
+    *errstr = "not a heat map";
+    fclose(fh);
+    return -1;
+  }
+
+  size = MIN(hdr.num_entries, map->num_chunks);
+  *missing = malloc(sizeof(e) * MAX(size, 1));
+  if (*missing == NULL) {
+    *errstr = "malloc() failed";
+    fclose(fh);
+    return -1;
+  }
+
+  for (i = 0; i < hdr.num_entries; i++) {
+    if (fread(&e, sizeof(e), 1, fh) != 1)
+      goto ERROR;
+
+    /* the device may have shrunk since */
+    if (e.chunk_no >= map->num_chunks)
+      continue;
+
+    entry = &map->entries[e.chunk_no];
+    if (entry->atime < e.atime) {
+      entry->atime = e.atime;
+      entry->refs = e.refs;
+    }
+
+    if ((entry->flags & CHUNK_CACHED) || (entry->atime < map->horizon) ||
+        (*num_missing >= size))
+      continue;
+
+    (*missing)[*num_missing] = e;
+    *num_missing += 1;
+  }
+
+  fclose(fh);
+
+  return 0;
+
+ERROR:
+  *errstr = (ferror(fh) ? strerror(errno) : "heat map truncated");
+  fclose(fh);
+  free(*missing);
+  *missing = NULL;
+  *num_missing = 0;
+  return -1;
+}
@@ -39,22 +39,30 @@
 #define logwarn(fmt, params ...) \
   logwarnx(fmt ": %s", ## params, strerror(errno))
 
-enum eviction_mode {
-  SYNC_ONLY,
-  DELETE_IF_EQUAL,
-  SYNC_AND_DELETE
-};
+/* evict chunks used once first while they take more percent of the cache */
+#define A1_SHARE 25
+
+/* seconds between progress reports while prewarming */
+#define PREWARM_REPORT 5
 
 struct chunk_entry {
   time_t atime;
-  char name[17];
+  unsigned int refs; // from the chunk map, 0 if unknown
+  unsigned long long bytes; // disk space used
+  char name[CAS_HEX_SIZE]; // chunk or content-addressed object
+};
+
+/* what eviction still has to free */
+struct eviction {
+  unsigned long long bytes;
+  unsigned long files;
 };
 
 int running = 1;
 
+#if 0
 char buf[COMPR_CHUNKSIZE], compbuf[COMPR_CHUNKSIZE];
 
-#if 0
 /* demo, stores chunk not in S3, but in /var/tmp/<cachedir>.store */
 static void sync_chunk (struct config *cfg, struct device *dev, char *name,
                         enum eviction_mode evict)
@@ -184,258 +192,594 @@ ERROR:
 }
 #endif
 
-static void sync_chunk (struct config *cfg, struct device *dev, char *name,
-                        enum eviction_mode evict)
+/* append names of files with the given name length and, unless 0, size,
+   descending levels deep into two character subdirectories */
+static int read_dir (char *path, size_t namelen, off_t size, int levels,
+                     struct chunk_entry **chunks, size_t *num_chunks,
+                     size_t *size_chunks)
 {
-  int dir_fd, fd, equal, res;
-  struct flock flk;
-  struct stat st, st0;
-  size_t comprlen;
-  unsigned char local_md5[16], remote_md5[16];
-  struct s3connection *s3conn;
-  unsigned short code;
-  size_t contentlen;
-  static unsigned int conn_num = 0;
-  const char *err_str;
+  DIR *dir;
+  struct dirent *entry;
+  struct stat st;
+  char subdir[PATH_MAX];
+  int result = -1;
 
-  dir_fd = open(dev->cachedir, O_RDONLY|O_DIRECTORY);
-  if (dir_fd < 0) {
-    logwarn("open(): %s", dev->cachedir);
+  dir = opendir(path);
+  if (dir == NULL) {
+    logwarn("opendir(): %s", path);
     goto ERROR;
   }
 
-  /* open and lock chunk */
-  fd = openat(dir_fd, name,
-              (evict == SYNC_ONLY ? O_RDONLY : O_RDWR) | O_NOATIME);
-  if (fd < 0) {
-    logwarn("open(): %s/%s", dev->cachedir, name);
-    goto ERROR1;
-  }
+  /* read cachedir, save name and access time of each chunk */
+  for (errno = 0; (entry = readdir(dir)) != NULL; errno = 0) {
+    if ((entry->d_type == DT_DIR) && (levels > 0) &&
+        (strlen(entry->d_name) == 2) && (entry->d_name[0] != '.')) {
+      if ((snprintf(subdir, sizeof(subdir), "%s/%s", path,
+                    entry->d_name) >= (int) sizeof(subdir)) ||
+          (read_dir(subdir, namelen, size, levels - 1, chunks, num_chunks,
+                    size_chunks) != 0))
+        goto ERROR1;
+      continue;
+    }
 
-  flk.l_type = (evict == SYNC_ONLY ? F_RDLCK : F_WRLCK);
-  flk.l_whence = SEEK_SET;
-  flk.l_start = 0;
-  flk.l_len = CHUNKSIZE;
-  flk.l_pid = 0;
+    if ((entry->d_type != DT_REG) || (strlen(entry->d_name) != namelen))
+      continue;
 
-  if (fcntl(fd, F_OFD_SETLK, &flk) != 0) {
-    logwarn("cannot lock %s/%s", dev->cachedir, name);
-    goto ERROR2;
-  }
+    if (fstatat(dirfd(dir), entry->d_name, &st, 0) != 0) {
+      if (errno != ENOENT) {
+        logwarn("fstatat(): %s/%s", path, entry->d_name);
+        goto ERROR1;
+      }
+      continue;
+    }
+
+    if ((size != 0) && (st.st_size != size))
+      continue;
 
-  if (fstatat(dir_fd, name, &st0, 0) != 0) {
-    /* chunk was removed while we waited for the lock */
-    if (errno != ENOENT) {
-      logwarn("fstatat(): %s/%s", dev->cachedir, name);
+    if (*num_chunks >= *size_chunks) {
+      *size_chunks = *size_chunks * 2 + 4096;
+      *chunks = realloc(*chunks, sizeof(struct chunk_entry) * *size_chunks);
+      if (*chunks == NULL)
+        errdiex("realloc() failed");
     }
 
-    goto ERROR2;
+    (*chunks)[*num_chunks].atime = st.st_atim.tv_sec;
+    (*chunks)[*num_chunks].refs = 0;
+    (*chunks)[*num_chunks].bytes = (unsigned long long) st.st_blocks * 512;
+    /* namelen is below CAS_HEX_SIZE, the length was checked above */
+    memcpy((*chunks)[*num_chunks].name, entry->d_name, namelen + 1);
+
+    *num_chunks += 1;
   }
 
-  if (fstat(fd, &st) != 0) {
-    logwarn("fstat(): %s/%s", dev->cachedir, name);
-    goto ERROR2;
+  result = 0;
+
+  if (errno != 0) {
+    logwarn("readdir(): %s", path);
+    result = -1;
   }
 
-  if (st.st_ino != st0.st_ino) {
-    /* the file we opened and the current file on disk are not the same */
-    goto ERROR2;
+ERROR1:
+  if (closedir(dir) != 0) {
+    logwarn("closedir(): %s", path);
+    result = -1;
   }
 
-  if (st.st_size != CHUNKSIZE) {
-    /* chunk is being fetched by s3blkdev */
-    logwarnx("%s/%s: filesize %lu != CHUNKSIZE",
-             dev->cachedir, name, st.st_size);
-    goto ERROR2;
+ERROR:
+  return result;
+}
+
+/* read names of files with the given name length and, unless 0, size; of
+   chunks, in either layout */
+static int read_cache_dir (char *cachedir, size_t namelen, off_t size,
+                           int levels, struct chunk_entry **chunks,
+                           size_t *num_chunks, size_t *size_chunks)
+{
+  *num_chunks = 0;
+
+  return read_dir(cachedir, namelen, size, levels, chunks, num_chunks,
+                  size_chunks);
+}
+
+/* like read_cache_dir(), but from the chunk map, which flags the cached
+   chunks and knows their access times and references even on filesystems
+   mounted noatime. lists all cached chunks, or else only those written to
+   since their last upload or due for verification. the disk space a chunk
+   uses is taken to be CHUNKSIZE */
+static void read_chunkmap (struct config *cfg, struct device *dev,
+                           int all, struct chunk_entry **chunks,
+                           size_t *num_chunks, size_t *size_chunks)
+{
+  struct chunkmap_entry *entry;
+  uint64_t i;
+  uint32_t gen;
+  time_t now = time(NULL);
+  int dirty;
+
+  for (*num_chunks = 0, i = 0; i < dev->chunkmap->num_chunks; i++) {
+    entry = &dev->chunkmap->entries[i];
+    gen = entry->gen;
+    dirty = (gen != entry->synced_gen);
+
+    if (!all && !dirty &&
+        ((entry->verified == 0) || manifest_known(cfg, entry, now)))
+      continue;
+
+    /* s3blkdevd flags a chunk cached before it marks it dirty */
+    __sync_synchronize();
+    if (!(entry->flags & CHUNK_CACHED)) {
+      /* nothing cached, so nothing to upload */
+      if (dirty)
+        entry->synced_gen = gen;
+      continue;
+    }
+
+    if (*num_chunks >= *size_chunks) {
+      *size_chunks = *size_chunks * 2 + 4096;
+      *chunks = realloc(*chunks, sizeof(struct chunk_entry) * *size_chunks);
+      if (*chunks == NULL)
+        errdiex("realloc() failed");
+    }
+
+    (*chunks)[*num_chunks].atime = entry->atime;
+    (*chunks)[*num_chunks].refs = entry->refs;
+    (*chunks)[*num_chunks].bytes = CHUNKSIZE;
+    snprintf((*chunks)[*num_chunks].name, sizeof((*chunks)[0].name),
+             "%016llx", (unsigned long long) i);
+
+    *num_chunks += 1;
   }
+}
 
-  /* read chunk */
-  if (read(fd, buf, CHUNKSIZE) != CHUNKSIZE) {
-    logwarn("read(): %s/%s", dev->cachedir, name);
-    goto ERROR2;
+/* the slots of a device with a cachefile are its space and its inodes,
+   one chunk each; dev is NULL for casdir */
+static int cache_statfs (char *cachedir, struct device *dev,
+                         struct statfs *fs)
+{
+  if ((dev == NULL) || (dev->num_slots == 0))
+    return statfs(cachedir, fs);
+
+  memset(fs, 0, sizeof(*fs));
+  fs->f_bsize = CHUNKSIZE;
+  fs->f_blocks = dev->num_slots;
+  fs->f_bavail = dev->num_slots - slots_used(dev);
+  fs->f_files = fs->f_blocks;
+  fs->f_ffree = fs->f_bavail;
+
+  return 0;
+}
+
+static int eviction_needed (char *cachedir, struct device *dev,
+                            unsigned int max_used_pct)
+{
+  struct statfs fs;
+  unsigned int min_free_pct = 100 - max_used_pct;
+
+  if (cache_statfs(cachedir, dev, &fs) != 0) {
+    logwarn("statfs(): %s", cachedir);
+    return 0;
   }
 
-  /* uncompress chunk */
-  comprlen = sizeof(compbuf);
-  res = snappy_compress(buf, CHUNKSIZE, compbuf, &comprlen);
-  if (res != SNAPPY_OK) {
-    logwarnx("snappy_compress(): %s/%s: %i", dev->cachedir, name, res);
-    goto ERROR2;
+  /* eviction needed if used space or inodes are above max_used_pct */
+  return ((fs.f_bavail * 100 / fs.f_blocks < min_free_pct) ||
+          (fs.f_ffree * 100 / fs.f_files < min_free_pct));
+}
+
+/* how much space and how many inodes to free until no more than
+   max_used_pct of the filesystem are in use */
+static int eviction_target (char *cachedir, struct device *dev,
+                            unsigned int max_used_pct,
+                            struct eviction *target)
+{
+  struct statfs fs;
+  unsigned long long min_free_pct = 100 - max_used_pct, want;
+
+  target->bytes = 0;
+  target->files = 0;
+
+  if (cache_statfs(cachedir, dev, &fs) != 0) {
+    logwarn("statfs(): %s", cachedir);
+    return -1;
   }
 
-  /* get md5 of chunk */
-  res = gnutls_hash_fast(GNUTLS_DIG_MD5, compbuf, comprlen, local_md5);
-  if (res != GNUTLS_E_SUCCESS) {
-    logwarnx("gnutls_hash_fast(): %s", gnutls_strerror(res));
-    goto ERROR2;
+  want = (fs.f_blocks * min_free_pct + 99) / 100;
+  if (fs.f_bavail < want)
+    target->bytes = (want - fs.f_bavail) * fs.f_bsize;
+
+  want = (fs.f_files * min_free_pct + 99) / 100;
+  if (fs.f_ffree < want)
+    target->files = want - fs.f_ffree;
+
+  return 0;
+}
+
+/* account for what has been freed; returns 1 once the target is met. only
+   then statfs() is asked again, as others may have used space meanwhile */
+static int eviction_done (char *cachedir, struct device *dev,
+                          unsigned int max_used_pct, struct eviction *target,
+                          unsigned long long bytes, unsigned long files)
+{
+  target->bytes -= MIN(target->bytes, bytes);
+  target->files -= MIN(target->files, files);
+
+  if ((target->bytes > 0) || (target->files > 0))
+    return 0;
+
+  if (eviction_target(cachedir, dev, max_used_pct, target) != 0)
+    return 1;
+
+  return ((target->bytes == 0) && (target->files == 0));
+}
+
+/* hand chunks to the uploaders in batches expected to meet the target,
+   then account for what they actually freed */
+static void evict_chunks (struct device *dev, struct chunk_entry *chunks,
+                          size_t start, size_t stop, enum eviction_mode evict,
+                          unsigned int min_used_pct, struct eviction *target)
+{
+  unsigned long long bytes = dev->bytes_evicted, batch_bytes = 0;
+  unsigned long files = dev->chunks_evicted, batch_files = 0;
+  size_t i;
+
+  for (i = start; (i < stop) && running; i++) {
+    /* chunk was deleted during first round of eviction */
+    if (chunks[i].name[0] == '\0')
+      continue;
+
+    if ((batch_bytes >= target->bytes) && (batch_files >= target->files)) {
+      upload_wait();
+
+      if (eviction_done(dev->cachedir, dev, min_used_pct, target,
+                        dev->bytes_evicted - bytes,
+                        dev->chunks_evicted - files))
+        return;
+
+      bytes = dev->bytes_evicted;
+      files = dev->chunks_evicted;
+      batch_bytes = 0;
+      batch_files = 0;
+    }
+
+    upload_chunk(dev, chunks[i].name, evict);
+    batch_bytes += chunks[i].bytes;
+    batch_files++;
   }
 
-  /* fetch md5 (etag) */
-  s3conn = s3_get_conn(cfg, &conn_num, &err_str);
-  if (s3conn == NULL) {
-    logwarnx("s3_get_conn(): %s", err_str);
-    goto ERROR2;
+  upload_wait();
+
+  eviction_done(dev->cachedir, dev, min_used_pct, target,
+                dev->bytes_evicted - bytes, dev->chunks_evicted - files);
+}
+
+/* qsort() callback, sort by ascending access times */
+static int compare_atimes (const void *a0, const void *b0)
+{
+  struct chunk_entry *a = (struct chunk_entry*) a0;
+  struct chunk_entry *b = (struct chunk_entry*) b0;
+
+  if (a->atime == b->atime) return 0;
+  return (a->atime < b->atime ? -1 : 1);
+}
+
+/* order chunks sorted by access time for eviction like 2Q does: chunks
+   used just once (A1) go first, but only as far as they take more than
+   A1_SHARE percent of the cache; then chunks used repeatedly (Am), then
+   the remaining A1 chunks. a large sequential read so only displaces
+   chunks used once */
+static void order_2q (struct chunk_entry *chunks, size_t num_chunks)
+{
+  struct chunk_entry *ordered;
+  size_t num_a1 = 0, a1_excess, i, j, k;
+
+  if (num_chunks == 0)
+    return;
+
+  ordered = malloc(sizeof(ordered[0]) * num_chunks);
+  if (ordered == NULL)
+    errdiex("malloc() failed");
+
+  for (i = 0; i < num_chunks; i++)
+    num_a1 += (chunks[i].refs < 2);
+
+  a1_excess = num_a1 - MIN(num_a1, num_chunks * A1_SHARE / 100);
+
+  for (i = j = k = 0; i < num_chunks; i++) {
+    if (chunks[i].refs >= 2)
+      continue;
+    if (k++ < a1_excess)
+      ordered[j++] = chunks[i];
   }
 
-  res = s3_request(cfg, s3conn, &err_str, HEAD, dev->name, name, NULL, 0,
-                   local_md5, &code, &contentlen, remote_md5, buf,
-                   sizeof(buf));
-  if (res != 0) {
-    logwarnx("s3_request(): %s/%s/%s/%s: %s", s3conn->host, s3conn->bucket,
-            dev->name, name, err_str);
-    goto ERROR3;
+  for (i = 0; i < num_chunks; i++) {
+    if (chunks[i].refs >= 2)
+      ordered[j++] = chunks[i];
   }
 
-  if (code == 200) {
-    /* found chunk, compare md5 checksum to local one */
-    equal = !memcmp(local_md5, remote_md5, 16);
-  } else if (code == 404) {
-    /* chunk not found */
-    equal = 0;
-  } else {
-    logwarnx("s3_request(): %s/%s/%s/%s: HTTP status %hu", s3conn->host,
-            s3conn->bucket, dev->name, name, code);
-    goto ERROR3;
+  for (i = k = 0; i < num_chunks; i++) {
+    if (chunks[i].refs >= 2)
+      continue;
+    if (k++ >= a1_excess)
+      ordered[j++] = chunks[i];
   }
 
-  if (!equal && (evict != DELETE_IF_EQUAL)) {
-    /* upload chunk */
-#if 0
-    s3_release_conn(s3conn);
+  memcpy(chunks, ordered, sizeof(ordered[0]) * num_chunks);
+  free(ordered);
+}
 
-    s3conn = s3_get_conn(cfg, &conn_num, &err_str);
-    if (s3conn == NULL) {
-      logwarnx("s3_get_conn(): %s", err_str);
-      goto ERROR2;
-    }
-#endif
+/* remember how long the cache keeps chunks, so s3blkdevd forgets the
+   references of chunks gone for longer */
+static void set_horizon (struct device *dev, struct chunk_entry *chunks,
+                         size_t num_chunks)
+{
+  time_t horizon = time(NULL);
+  size_t i;
 
-    res = s3_request(cfg, s3conn, &err_str, PUT, dev->name, name, compbuf,
-                     comprlen, local_md5, &code, &contentlen, remote_md5, buf,
-                     sizeof(buf));
-    if (res != 0) {
-      logwarnx("s3_request(): %s/%s/%s/%s: %s", s3conn->host, s3conn->bucket,
-              dev->name, name, err_str);
-      goto ERROR3;
-    }
+  for (i = 0; i < num_chunks; i++) {
+    if ((chunks[i].name[0] != '\0') && (chunks[i].atime < horizon))
+      horizon = chunks[i].atime;
+  }
 
-    if (code != 200) {
-      logwarnx("s3_request(): %s/%s/%s/%s: HTTP status %hu", s3conn->host,
-              s3conn->bucket, dev->name, name, code);
-      goto ERROR3;
-    }
+  dev->chunkmap->horizon = horizon;
+}
 
-    syslog(LOG_INFO, "synced %s/%s\n", dev->cachedir, name);
-  }
+/* local copies of content-addressed objects are always in S3 as well,
+   so just delete the least recently used ones */
+static void evict_casdir (char *casdir, unsigned int max_used_pct,
+                          unsigned int min_used_pct)
+{
+  struct chunk_entry *objs = NULL;
+  struct eviction target;
+  size_t num_objs, size_objs = 0, i;
+  unsigned long long bytes = 0;
+  unsigned long files = 0;
+  int dir_fd;
+
+  if (!eviction_needed(casdir, NULL, max_used_pct) ||
+      (eviction_target(casdir, NULL, min_used_pct, &target) != 0))
+    return;
+
+  if (read_cache_dir(casdir, CAS_HEX_SIZE - 1, 0, 0, &objs, &num_objs,
+                     &size_objs) != 0)
+    goto ERROR;
 
-  if ((equal && (evict == DELETE_IF_EQUAL)) || (evict == SYNC_AND_DELETE)) {
-    if (unlinkat(dir_fd, name, 0) != 0) {
-      logwarn("unlinkat(): %s/%s", dev->cachedir, name);
-      goto ERROR3;
-    }
+  qsort(objs, num_objs, sizeof(objs[0]), compare_atimes);
 
-    syslog(LOG_INFO, "evicted %s/%s\n", dev->cachedir, name);
-    *name = '\0';
+  if ((dir_fd = open(casdir, O_RDONLY|O_DIRECTORY)) < 0) {
+    logwarn("open(): %s", casdir);
+    goto ERROR;
   }
 
-ERROR3:
-  s3_release_conn(s3conn);
+  for (i = 0; (i < num_objs) && running; i++) {
+    if (eviction_done(casdir, NULL, min_used_pct, &target, bytes, files))
+      break;
 
-ERROR2:
-  if (close(fd) < 0)
-    logwarn("close(): %s/%s", dev->cachedir, name);
+    bytes = 0;
+    files = 0;
+
+    if (unlinkat(dir_fd, objs[i].name, 0) == 0) {
+      bytes = objs[i].bytes;
+      files = 1;
+    } else if (errno != ENOENT) {
+      logwarn("unlinkat(): %s/%s", casdir, objs[i].name);
+    }
+  }
 
-ERROR1:
   if (close(dir_fd) < 0)
-    logwarn("close(): %s", dev->cachedir);
+    logwarn("close(): %s", casdir);
 
 ERROR:
-  return;
+  free(objs);
 }
 
-static int read_cache_dir (char *cachedir, struct chunk_entry **chunks,
-                           size_t *num_chunks, size_t *size_chunks)
+/* move all chunks of a device into the layout configured for it, see
+   chunk_migrate(); s3blkdevd may keep using the device meanwhile */
+static void migrate_chunks (struct device *dev, struct chunk_entry **chunks,
+                            size_t *size_chunks)
 {
-  DIR *dir;
-  struct dirent *entry;
-  struct stat st;
-  int result = -1;
+  size_t num_chunks, i;
+  unsigned long moved = 0;
+  char path[6];
+  int dir_fd, res;
 
-  dir = opendir(cachedir);
-  if (dir == NULL) {
-    logwarn("opendir(): %s", cachedir);
-    goto ERROR;
-  }
+  if (read_cache_dir(dev->cachedir, 16, 0, 2, chunks, &num_chunks,
+                     size_chunks) != 0)
+    return;
 
-  /* read cachedir, save name and access time of each chunk */
-  for (*num_chunks = 0, errno = 0; (entry = readdir(dir)) != NULL; errno = 0) {
-    if ((entry->d_type != DT_REG) || (strlen(entry->d_name) != 16))
-      continue;
+  dir_fd = open(dev->cachedir, O_RDONLY|O_DIRECTORY);
+  if (dir_fd < 0) {
+    logwarn("open(): %s", dev->cachedir);
+    return;
+  }
 
-    if (fstatat(dirfd(dir), entry->d_name, &st, 0) != 0) {
-      if (errno != ENOENT) {
-        logwarn("fstatat(): %s/%s", cachedir, entry->d_name);
-        goto ERROR1;
-      }
+  for (i = 0; (i < num_chunks) && running; i++) {
+    res = chunk_migrate(dir_fd, dev, (*chunks)[i].name);
+    if (res < 0) {
+      logwarn("chunk_migrate(): %s/%s", dev->cachedir, (*chunks)[i].name);
+    } else {
+      moved += res;
     }
+  }
 
-    if (st.st_size != CHUNKSIZE)
-      continue;
+  /* remove the subdirectories of the hashed layout, unless in use again */
+  for (i = 0; !dev->hashed && (i < 256 * 257) && running; i++) {
+    if (i < 256 * 256)
+      snprintf(path, sizeof(path), "%02zx/%02zx", i / 256, i % 256);
+    else
+      snprintf(path, sizeof(path), "%02zx", i - 256 * 256);
 
-    if (*num_chunks >= *size_chunks) {
-      *size_chunks = *size_chunks * 2 + 4096;
-      *chunks = realloc(*chunks, sizeof(struct chunk_entry) * *size_chunks);
-      if (*chunks == NULL)
-        errdiex("realloc() failed");
-    }
+    if ((unlinkat(dir_fd, path, AT_REMOVEDIR) != 0) && (errno != ENOENT) &&
+        (errno != ENOTEMPTY))
+      logwarn("unlinkat(): %s/%s", dev->cachedir, path);
+  }
 
-    (*chunks)[*num_chunks].atime = st.st_atim.tv_sec;
-    strncpy((*chunks)[*num_chunks].name, entry->d_name,
-            sizeof((*chunks)[0].name));
+  if (close(dir_fd) != 0)
+    logwarn("close(): %s", dev->cachedir);
 
-    *num_chunks += 1;
+  syslog(LOG_INFO, "migrated %lu of %zu chunks in %s\n", moved, num_chunks,
+         dev->cachedir);
+}
+
+/* a position on a device in bytes, optionally suffixed K, M, G or T, or
+   in chunks, suffixed C */
+static int parse_pos (char *str, char **end, unsigned long long *pos)
+{
+  int shift = 0;
+
+  *pos = strtoull(str, end, 0);
+  if (*end == str)
+    return -1;
+
+  switch (**end) {
+    case 'T': shift += 10; /* fall thru */
+    case 'G': shift += 10; /* fall thru */
+    case 'M': shift += 10; /* fall thru */
+    case 'K': shift += 10; (*end)++; break;
+    case 'C': shift = -1; (*end)++; break;
   }
 
-  result = 0;
+  if (shift < 0)
+    *pos *= CHUNKSIZE;
+  else
+    *pos <<= shift;
 
-  if (errno != 0) {
-    logwarn("readdir(): %s", cachedir);
-    result = -1;
+  return 0;
+}
+
+static void add_chunk (unsigned long long chunk_no,
+                       struct chunk_entry **chunks, size_t *num_chunks,
+                       size_t *size_chunks)
+{
+  if (*num_chunks >= *size_chunks) {
+    *size_chunks = *size_chunks * 2 + 4096;
+    *chunks = realloc(*chunks, sizeof(struct chunk_entry) * *size_chunks);
+    if (*chunks == NULL)
+      errdiex("realloc() failed");
   }
 
-ERROR1:
-  if (closedir(dir) != 0) {
-    logwarn("closedir(): %s", cachedir);
-    result = -1;
+  memset(&(*chunks)[*num_chunks], 0, sizeof((*chunks)[0]));
+  snprintf((*chunks)[*num_chunks].name, sizeof((*chunks)[0].name),
+           "%016llx", chunk_no);
+
+  *num_chunks += 1;
+}
+
+/* the chunks of a range of a device, given as <start>-<end>,
+   <start>+<length>, or just a position within a chunk */
+static int add_range (struct device *dev, char *range,
+                      struct chunk_entry **chunks, size_t *num_chunks,
+                      size_t *size_chunks)
+{
+  unsigned long long start, end;
+  char *p, sep;
+
+  if (parse_pos(range, &p, &start) != 0)
+    return -1;
+
+  sep = *p;
+  if (sep == '\0') {
+    end = start + 1;
+  } else if (((sep != '-') && (sep != '+')) ||
+             (parse_pos(p + 1, &p, &end) != 0) || (*p != '\0')) {
+    return -1;
+  } else if (sep == '+') {
+    end += start;
   }
 
-ERROR:
-  return result;
+  if ((start >= dev->size) || (end <= start))
+    return -1;
+
+  end = MIN(end, dev->size);
+
+  for (start /= CHUNKSIZE; start * CHUNKSIZE < end; start++)
+    add_chunk(start, chunks, num_chunks, size_chunks);
+
+  return 0;
 }
 
-static int eviction_needed (char *cachedir, unsigned int max_used_pct)
+/* the chunks listed in a file, one per line, by name or by a path ending
+   in it, like ls or find list a cachedir; "-" reads stdin */
+static void read_chunk_list (struct device *dev, char *list,
+                             struct chunk_entry **chunks, size_t *num_chunks,
+                             size_t *size_chunks)
 {
-  struct statfs fs;
-  unsigned int min_free_pct = 100 - max_used_pct;
+  FILE *fh;
+  char line[PATH_MAX], *name;
+  unsigned long long chunk_no;
+  size_t len;
 
-  if (statfs(cachedir, &fs) != 0) {
-    logwarn("statfs(): %s", cachedir);
-    return 0;
+  fh = (strcmp(list, "-") ? fopen(list, "r") : stdin);
+  if (fh == NULL)
+    errdie("fopen(): %s", list);
+
+  while (fgets(line, sizeof(line), fh) != NULL) {
+    len = strcspn(line, " \t\r\n");
+    line[len] = '\0';
+
+    name = strrchr(line, '/');
+    name = (name == NULL ? line : name + 1);
+
+    /* anything else a cachedir holds */
+    if ((strlen(name) != 16) || (strspn(name, "0123456789abcdef") != 16))
+      continue;
+
+    chunk_no = strtoull(name, NULL, 16);
+    if (chunk_no * CHUNKSIZE < dev->size)
+      add_chunk(chunk_no, chunks, num_chunks, size_chunks);
   }
 
-  /* eviction needed if used space or inodes are above max_used_pct */
-  return ((fs.f_bavail * 100 / fs.f_blocks < min_free_pct) ||
-          (fs.f_ffree * 100 / fs.f_files < min_free_pct));
+  if (ferror(fh))
+    errdie("fgets(): %s", list);
+
+  if (fh != stdin)
+    fclose(fh);
 }
 
-/* qsort() callback, sort by ascending access times */
-static int compare_atimes (const void *a0, const void *b0)
+static void prewarm_progress (struct device *dev, size_t done, size_t total,
+                              struct timespec *start)
 {
-  struct chunk_entry *a = (struct chunk_entry*) a0;
-  struct chunk_entry *b = (struct chunk_entry*) b0;
+  struct timespec now;
+  double secs;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  secs = now.tv_sec - start->tv_sec + (now.tv_nsec - start->tv_nsec) / 1e9;
+  if (secs < 0.001)
+    secs = 0.001;
+
+  syslog(LOG_INFO, "prewarming %s: %zu of %zu chunks, %lu fetched, "
+         "%.1f MiB/s cached, %.1f MiB/s from S3\n", dev->name, done, total,
+         dev->chunks_prewarmed,
+         dev->chunks_prewarmed * (CHUNKSIZE / 1048576.0) / secs,
+         dev->bytes_prewarmed / 1048576.0 / secs);
+  printf("%s: %zu of %zu chunks, %lu fetched, %.1f MiB/s cached, "
+         "%.1f MiB/s from S3\n", dev->name, done, total,
+         dev->chunks_prewarmed,
+         dev->chunks_prewarmed * (CHUNKSIZE / 1048576.0) / secs,
+         dev->bytes_prewarmed / 1048576.0 / secs);
+  fflush(stdout);
+}
 
-  if (a->atime == b->atime) return 0;
-  return (a->atime < b->atime ? -1 : 1);
+/* fetch chunks not cached yet with all uploaders */
+static void prewarm_chunks (struct device *dev, struct chunk_entry *chunks,
+                            size_t num_chunks)
+{
+  struct timespec start;
+  time_t last = time(NULL);
+  size_t i;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (i = 0; (i < num_chunks) && running; i++) {
+    upload_chunk(dev, chunks[i].name, PREWARM);
+
+    if (time(NULL) - last >= PREWARM_REPORT) {
+      prewarm_progress(dev, i + 1, num_chunks, &start);
+      last = time(NULL);
+    }
+  }
+
+  upload_wait();
+
+  prewarm_progress(dev, i, num_chunks, &start);
 }
 
 static void sigterm_handler (int sig __attribute__((unused)))
@@ -475,16 +819,33 @@ static void show_help ()
 "              [<start_pct> <stop_pct>]\n"
 "s3blkdev-sync [-c <config file>] -p <pid file> <max_used_pct> <min_used_pct>\n"
 "              [<start_pct> <stop_pct>]\n"
+"s3blkdev-sync [-c <config file>] -p <pid file> -m\n"
+"s3blkdev-sync [-c <config file>] -p <pid file> -w <device> [-l <list>]\n"
+"              [<range> ...]\n"
 "s3blkdev-sync -h\n"
 "\n"
 "  -c <config file>    read config options from specified file instead of\n"
 "                      " DEFAULT_CONFIGFILE "\n"
 "  -p <pid file>       save pid to this file\n"
+"  -j <threads>        upload or fetch with that many threads instead of\n"
+"                      the configured uploaders\n"
+"  -m                  run in migration mode: move chunks into the layout\n"
+"                      configured for their device\n"
+"  -w <device>         run in prewarm mode: fetch the given chunks of the\n"
+"                      device into its cache unless cached already\n"
+"  -l <list>           prewarm the chunks listed in this file (- for stdin),\n"
+"                      one per line, by name or by path as in a listing of a\n"
+"                      cache directory\n"
+"  <range>             prewarm the chunks of <start>-<end>, <start>+<length>\n"
+"                      or of just the chunk at <start>, given in bytes with\n"
+"                      an optional suffix K, M, G or T, or in chunks with\n"
+"                      suffix C\n"
 "  <runtime_seconds>   run in sync mode: upload any chunks which have been\n"
 "                      modified locally, stop after <runtime_seconds>\n"
 "  <max_used_pct>      run in eviction mode: if cache directory has more than\n"
-"                      <max_used_pct> percent diskspace in use, first upload,\n"
-"                      then delete chunks locally\n"
+"                      <max_used_pct> percent diskspace (or cachefile percent\n"
+"                      of its slots) in use, first upload, then delete chunks\n"
+"                      locally\n"
 "  <min_used_pct>      stop eviction if cache directory has no more than\n"
 "                      <min_used_pct> percent diskspace in use\n"
 "  <start_pct>         work on a subset of all chunks when running multiple\n"
@@ -500,24 +861,31 @@ int main (int argc, char **argv)
   int res;
   size_t num_chunks, size_chunks = 0, i, start, stop;
   struct chunk_entry *chunks = NULL;
-  enum { SYNCER, EVICTOR } mode;
+  enum { SYNCER, EVICTOR, MIGRATOR, PREWARMER } mode = SYNCER;
   unsigned int min_used_pct = 100, max_used_pct = 100, errline, devnum,
-               runtime_seconds = 0, deleted_chunks, start_pct = 0,
-               stop_pct = 100;
-  char *configfile = DEFAULT_CONFIGFILE, *pidfile = NULL;
+               runtime_seconds = 0, start_pct = 0, stop_pct = 100, jobs = 0;
+  char *configfile = DEFAULT_CONFIGFILE, *pidfile = NULL, *devicename = NULL,
+       *list = NULL;
+  struct chunk_entry *prewarm = NULL;
+  size_t num_prewarm = 0, size_prewarm = 0;
   const char *errstr;
   struct config cfg;
   struct device *dev;
+  struct eviction target;
   time_t start_time;
 
   openlog("s3blkdev-sync", LOG_NDELAY|LOG_PID, LOG_LOCAL1);
 
-  while ((res = getopt(argc, argv, "c:f:hp:")) != -1) {
+  while ((res = getopt(argc, argv, "c:f:hj:l:mp:w:")) != -1) {
     switch (res) {
       case 'c': configfile = optarg; break;
       case 'f': pidfile = optarg; break;
       case 'h': show_help(); return 0;
+      case 'j': jobs = atoi(optarg); break;
+      case 'l': list = optarg; break;
+      case 'm': mode = MIGRATOR; break;
       case 'p': pidfile = optarg; break;
+      case 'w': mode = PREWARMER; devicename = optarg; break;
       default: errdiex("Unknown option '%i'. See -h for help.", res);
     }
   }
@@ -525,7 +893,19 @@ int main (int argc, char **argv)
   if (pidfile == NULL)
     errdiex("Need pidfile. See -h for help.");
 
-  switch (argc - optind) {
+  if ((mode == MIGRATOR) && (argc != optind))
+    errdiex("Wrong parameters. See -h for help.");
+
+  if ((mode == PREWARMER) ? ((argc == optind) && (list == NULL)) :
+                            (list != NULL))
+    errdiex("Wrong parameters. See -h for help.");
+
+  /* ranges to prewarm are parsed below */
+  switch (mode == PREWARMER ? 0 : argc - optind) {
+    case 0:
+      if (mode != SYNCER)
+        break;
+      errdiex("Wrong parameters. See -h for help.");
     case 3:
       start_pct = atoi(argv[optind + 1]);
       stop_pct = atoi(argv[optind + 2]);
@@ -557,6 +937,31 @@ int main (int argc, char **argv)
     errdiex("Cannot load config file %s: %s (line %i)",
             configfile, errstr, errline);
 
+  if (jobs > 0) {
+    if (jobs >= MAX_IO_THREADS)
+      errdiex("Too many threads (max. %i). See -h for help.",
+              MAX_IO_THREADS - 1);
+    cfg.num_uploaders = jobs;
+    cfg.num_s3conns = MAX(cfg.num_s3conns, jobs);
+  }
+
+  if (mode == PREWARMER) {
+    for (devnum = 0; (devnum < cfg.num_devices) &&
+                     strcmp(cfg.devs[devnum].name, devicename); devnum++);
+    if (devnum == cfg.num_devices)
+      errdiex("Unknown device %s. See -h for help.", devicename);
+    dev = &cfg.devs[devnum];
+
+    for (i = optind; i < (size_t) argc; i++) {
+      if (add_range(dev, argv[i], &prewarm, &num_prewarm,
+                    &size_prewarm) != 0)
+        errdiex("Invalid range %s. See -h for help.", argv[i]);
+    }
+
+    if (list != NULL)
+      read_chunk_list(dev, list, &prewarm, &num_prewarm, &size_prewarm);
+  }
+
   if ((res = gnutls_global_init()) != GNUTLS_E_SUCCESS)
     errdiex("gnutls_global_init(): %s", gnutls_strerror(res));
 
@@ -565,14 +970,66 @@ int main (int argc, char **argv)
 
   setup_signals();
 
+  if (codec_start_workers(cfg.num_codec_threads, &errstr) != 0)
+    errdiex("codec_start_workers(): %s", errstr);
+
+  upload_stderr = 1;
+  if (upload_start_workers(&cfg, cfg.num_uploaders, 0, &errstr) != 0)
+    errdiex("upload_start_workers(): %s", errstr);
+
   for (devnum = 0; devnum < cfg.num_devices; devnum++) {
     dev = &cfg.devs[devnum];
 
-    if (read_cache_dir(dev->cachedir, &chunks, &num_chunks, &size_chunks) != 0)
+    if (mode == MIGRATOR) {
+      /* slots have no layout */
+      if (dev->cachefile[0] == '\0')
+        migrate_chunks(dev, &chunks, &size_chunks);
+      continue;
+    }
+
+    if ((mode == PREWARMER) && strcmp(dev->name, devicename))
       continue;
 
+    /* s3blkdevd only heeds locks in the map, so without a usable one,
+       the device is left alone while s3blkdevd runs */
+    if (chunkmap_open(dev, 0, &errstr) < 0) {
+      logwarnx("chunkmap_open(): %s/%s: %s, skipping device", dev->cachedir,
+               CHUNKMAP_FILE, errstr);
+      continue;
+    }
+
+    if (mode == PREWARMER) {
+      if ((dev->chunkmap == NULL) && (dev->cachefile[0] != '\0')) {
+        logwarnx("%s: no usable chunk map, skipping %s", dev->cachedir,
+                 dev->cachefile);
+      } else {
+        prewarm_chunks(dev, prewarm, num_prewarm);
+      }
+      chunkmap_close(dev, 0, &errstr);
+      continue;
+    }
+
+    /* the chunk map knows which chunks are cached and need to be synced */
+    if (dev->chunkmap != NULL) {
+      read_chunkmap(&cfg, dev, mode == EVICTOR, &chunks, &num_chunks,
+                    &size_chunks);
+    } else if (dev->cachefile[0] != '\0') {
+      /* only the map tells which chunk is in which slot */
+      logwarnx("%s: no usable chunk map, skipping %s", dev->cachedir,
+               dev->cachefile);
+      chunkmap_close(dev, 0, &errstr);
+      continue;
+    } else if (read_cache_dir(dev->cachedir, 16, CHUNKSIZE, 2, &chunks,
+                              &num_chunks, &size_chunks) != 0) {
+      chunkmap_close(dev, 0, &errstr);
+      continue;
+    }
+
     qsort(chunks, num_chunks, sizeof(chunks[0]), compare_atimes);
 
+    if ((mode == EVICTOR) && (dev->chunkmap != NULL))
+      order_2q(chunks, num_chunks);
+
     start = (num_chunks * start_pct) / 100;
     stop = (num_chunks * stop_pct) / 100;
 
@@ -585,41 +1042,39 @@ int main (int argc, char **argv)
 
       while ((i > start) && running) {
         i--;
-        sync_chunk(&cfg, dev, chunks[i].name, SYNC_ONLY);
+        upload_chunk(dev, chunks[i].name, SYNC_ONLY);
 
         if (time(NULL) - start_time >= runtime_seconds)
           break;
       }
-    } else if (eviction_needed(dev->cachedir, max_used_pct)) {
+    } else if (eviction_needed(dev->cachedir, dev, max_used_pct) &&
+               (eviction_target(dev->cachedir, dev, min_used_pct,
+                                &target) == 0)) {
       /* first round of eviction, delete local chunks which have already been
          uploaded */
-      deleted_chunks = 0;
-
-      for (i = start; (i < stop) && running; i++) {
-        if (!eviction_needed(dev->cachedir, min_used_pct))
-          break;
-
-        sync_chunk(&cfg, dev, chunks[i].name, DELETE_IF_EQUAL);
-
-        if (++deleted_chunks >= 100)
-          break;
-      }
+      evict_chunks(dev, chunks, start, stop, DELETE_IF_EQUAL, min_used_pct,
+                   &target);
 
       /* second round of eviction, upload and delete local chunks until
          free space is below given percentage */
-      for (i = start; (i < stop) && running; i++) {
-        /* chunk was deleted during first round of eviction */
-        if (chunks[i].name[0] == '\0')
-          continue;
-
-        if (eviction_needed(dev->cachedir, min_used_pct))
-          sync_chunk(&cfg, dev, chunks[i].name, SYNC_AND_DELETE);
-        else
-          break;
-      }
+      if ((target.bytes > 0) || (target.files > 0))
+        evict_chunks(dev, chunks, start, stop, SYNC_AND_DELETE, min_used_pct,
+                     &target);
+
+      if (dev->chunkmap != NULL)
+        set_horizon(dev, chunks, num_chunks);
     }
+
+    upload_wait();
+
+    chunkmap_close(dev, 0, &errstr);
   }
 
+  if ((mode == EVICTOR) && (cfg.casdir[0] != '\0') && running)
+    evict_casdir(cfg.casdir, max_used_pct, min_used_pct);
+
+  s3_log_stats(&cfg);
+
   gnutls_global_deinit();
 
   if (unlink(pidfile) != 0)
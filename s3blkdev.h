@@ -4,10 +4,12 @@
 #define S3BLKDEV_VERSION "0.10"
 
 #include <limits.h>
+#include <stdint.h>
 #include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <sys/socket.h>
 #include <gnutls/gnutls.h>
 
 #ifndef F_OFD_GETLK
@@ -23,16 +25,144 @@
 #define TCP_RMEM (1024*1024)
 #define TCP_WMEM (1024*1024)
 
+#define SOCKOPT_NODELAY 1
+#define SOCKOPT_FASTOPEN 2
+
 #define CHUNKSIZE (8 * 1024 * 1024)
 #define COMPR_CHUNKSIZE (CHUNKSIZE + CHUNKSIZE/4)
 
 #define DEFAULT_CONFIGFILE "/usr/local/etc/s3blkdev.conf"
 #define MAX_IO_THREADS 128
+#define MAX_DEVICES 128
 #define DEVNAME_SIZE 64
 
+/* a chunk's file below cachedir, "%016llx", or "ll/kk/%016llx" hashed by
+   its lowest two bytes */
+#define CHUNK_PATH_SIZE (6 + 16 + 1)
+
 #define MIN(a,b) ((a)>(b)?(b):(a))
 #define MAX(a,b) ((a)<(b)?(b):(a))
 
+/* chunk object codecs, stored in the object header */
+enum codec {
+  CODEC_NONE = 0,
+  CODEC_SNAPPY = 1,
+  CODEC_LZ4 = 2,
+  CODEC_ZSTD = 3
+};
+
+#define CODEC_HEADER_SIZE 16
+
+/* AES-256-GCM encryption of chunk objects */
+#define CODEC_KEY_SIZE 32
+
+/* content-addressed objects and the references to them */
+#define CODEC_REF 0x80
+#define CAS_FOLDER "cas"
+#define CAS_DIGEST_SIZE 32
+#define CAS_HEX_SIZE (2 * CAS_DIGEST_SIZE + 1)
+#define CODEC_REF_SIZE (CODEC_HEADER_SIZE + CAS_DIGEST_SIZE)
+
+/* per-device map of dirty chunks, shared by s3blkdevd and s3blkdev-sync,
+   which also keeps a manifest of the objects it uploaded in it */
+#define CHUNKMAP_FILE ".chunkmap"
+#define CHUNKMAP_MAGIC 0x706d6b63
+#define CHUNKMAP_VERSION 6
+
+#define CHUNK_CACHED 1 // complete in cachedir or its slot
+
+/* the lock word of a chunk in the map. s3blkdevd's threads take it with
+   atomic operations alone, and sleep on it as a futex only if contended.
+   s3blkdev-sync and the write-back mark their holds with an OFD lock on
+   the chunk's entry in the map file, too, so holds left by a crashed
+   s3blkdev-sync can be told from live ones */
+#define CHUNK_LOCK_READERS 0x0000ffff // s3blkdevd threads holding it shared
+#define CHUNK_LOCK_SYNC_ONE 0x00010000
+#define CHUNK_LOCK_SYNC_READERS 0x0fff0000 // uploads holding it shared
+#define CHUNK_LOCK_SYNC_EXCL 0x10000000 // an upload holds it exclusive
+#define CHUNK_LOCK_EXCL 0x20000000 // an s3blkdevd thread holds it exclusive
+#define CHUNK_LOCK_WAITERS 0x40000000 // s3blkdevd threads sleep on it
+
+/* references to a chunk closer than HEAT_CORRELATION seconds count as one */
+#define HEAT_CORRELATION 60
+
+struct chunkmap_entry {
+  uint32_t gen; // bumped by s3blkdevd on each write
+  uint32_t synced_gen; // generation last uploaded by s3blkdev-sync
+  uint32_t verified; // time md5 was last checked against S3, 0 if unknown
+  uint32_t dirtied; // time of the first write since the last upload
+  unsigned char md5[16]; // of the object in S3
+  uint32_t atime; // last read or write by s3blkdevd, 0 if never
+  uint32_t refs; // uncorrelated references, see HEAT_CORRELATION
+  uint32_t flags;
+  uint32_t slot; // slot + 1 holding the chunk, 0 if none
+  uint32_t lock; // see CHUNK_LOCK_READERS
+  uint32_t reserved;
+};
+
+struct chunkmap {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t num_chunks;
+  uint32_t clean; // closed by s3blkdevd, no writes are missing
+  uint32_t horizon; // oldest atime of the chunks left by the last eviction
+  uint32_t num_slots;
+  uint32_t reserved;
+  uint64_t slot_seq; // last sequence number of a slot header
+  struct chunkmap_entry entries[];
+  /* followed by num_slots times chunk_no + 1 held by the slot, 0 if free */
+};
+
+#define CHUNKMAP_SLOTS(map) ((uint32_t *) &(map)->entries[(map)->num_chunks])
+
+/* cache I/O with O_DIRECT bypasses the page cache, which the NBD client
+   caches the same data in already. buffers and ranges must be aligned to
+   the logical block size for that, or get bounced */
+#define DIRECT_ALIGN 4096 // largest logical block size supported
+#define DIRECT_LOCKS 64 // serializing read-modify-write of partial blocks
+
+/* instead of a file per chunk in cachedir, a device may cache chunks in
+   the slots of one preallocated file or block device, accessed with
+   O_DIRECT. a header block in front of each slot names its chunk, so the
+   slots in the chunk map can be rebuilt after a crash */
+#define SLOT_HEADER DIRECT_ALIGN
+#define SLOT_SIZE ((off_t) SLOT_HEADER + CHUNKSIZE)
+#define SLOT_DATA(slot) ((off_t) (slot) * SLOT_SIZE + SLOT_HEADER)
+#define SLOT_MAGIC 0x746f6c73
+
+struct slot_header {
+  uint32_t magic;
+  uint32_t reserved;
+  uint64_t seq; // of slots claiming the same chunk, the highest one wins
+  uint64_t chunk_no;
+};
+
+/* the heat map of a device, see heat.c: a header, followed by the access
+   statistics of the chunks in the cache when it was saved, hottest first */
+#define HEAT_MAGIC 0x74616568
+#define HEAT_VERSION 1
+#define HEAT_SAVE_INTERVAL 300 // seconds, besides on exit
+
+struct heat_header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t num_chunks; // of the device
+  uint64_t num_entries;
+};
+
+struct heat_entry {
+  uint64_t chunk_no;
+  uint32_t atime;
+  uint32_t refs;
+};
+
+enum eviction_mode {
+  SYNC_ONLY,
+  DELETE_IF_EQUAL,
+  SYNC_AND_DELETE,
+  PREWARM // the opposite: fetch the chunk into the cache
+};
+
 enum httpverb {
   GET,
   HEAD,
@@ -43,43 +173,141 @@ struct device {
   char name[DEVNAME_SIZE];
   char cachedir[PATH_MAX];
   size_t size;
+  int codec;
+  int codec_level;
+  unsigned char min_saving; // store raw if compression saves less (percent)
+  unsigned char dedup; // store chunks content-addressed
+  unsigned char hashed; // cachedir layout, see CHUNK_PATH_SIZE
+  unsigned char direct; // chunk files with O_DIRECT, see DIRECT_ALIGN
+  char cachefile[PATH_MAX]; // slots instead of cachedir, unless empty
+  unsigned long long cachefile_size; // to preallocate a regular file
+  int cachefile_fd;
+  uint32_t num_slots;
+  uint32_t slot_hint; // where to look for a free slot next
+  unsigned int direct_align; // O_DIRECT alignment, the logical block size
+  pthread_mutex_t direct_mtx[DIRECT_LOCKS];
+  char heatfile[PATH_MAX]; // heat map kept across restarts, unless empty
+  unsigned char encrypt;
+  unsigned char key[2 * CODEC_KEY_SIZE]; // encryption key, nonce key
+  unsigned long chunks_coded;
+  unsigned long chunks_raw;
+  unsigned long chunks_dedup; // upload skipped, content already stored
+  unsigned long chunks_evicted;
+  unsigned long long bytes_evicted; // disk space freed by evicted chunks
+  unsigned long chunks_prewarmed;
+  unsigned long long bytes_prewarmed; // fetched from S3 for prewarming
+  struct chunkmap *chunkmap; // NULL if not tracking dirty chunks
+  int chunkmap_fd; // also held by s3blkdev-sync working without the map
+  size_t seq_next; // end of last read, to detect sequential reads
+  size_t seq_len;
+};
+
+#define S3_MAX_ADDRS 8
+
+#define S3_KTLS_TX 1
+#define S3_KTLS_RX 2
+
+/* one s3host/s3port combination and its observed health */
+struct s3endpoint {
+  char *host;
+  char *port;
+  struct sockaddr_storage addrs[S3_MAX_ADDRS];
+  socklen_t addrlens[S3_MAX_ADDRS];
+  unsigned int num_addrs;
+  time_t addrs_expire;
+  unsigned int ewma_usec;
+  unsigned int inflight;
+  unsigned int failures;
+  time_t ejected_until;
+  unsigned long requests;
+  unsigned long errors;
+  pthread_mutex_t mtx;
+};
+
+#define S3_HEDGE_BUCKETS 128
+#define S3_MAX_PARTS 16
+
+/* distribution of recent GET times to first byte, used to decide when to
+   send a hedged GET */
+struct s3hedge {
+  unsigned int buckets[S3_HEDGE_BUCKETS];
+  unsigned int samples;
+  unsigned int gets;
+  unsigned int hedged;
+  pthread_mutex_t mtx;
 };
 
 struct s3connection {
+  struct s3endpoint *endpoint;
   char *host;
   char *name;
   char *port;
   char *bucket;
   int sock;
   int is_ssl;
+  int ktls; // directions offloaded to kernel tls
   int is_error;
   unsigned int timeout;
   unsigned short remaining_reqs;
+  unsigned int ttfb_usec;
+  size_t objlen;
   gnutls_session_t tls_sess;
   gnutls_certificate_credentials_t tls_cred;
   pthread_mutex_t mtx;
 };
 
+/* AWS signature v4 signing key, derived once per day and shared by all
+   connections */
+struct s3sigkey {
+  char date[9];
+  unsigned char key[32];
+  pthread_mutex_t mtx;
+};
+
 struct config {
   char s3hosts[4][256];
   unsigned short num_s3hosts;
   char s3ports[4][8];
   unsigned short num_s3ports;
   unsigned char s3ssl;
+  unsigned char s3ktls;
   char s3name[128];
   char s3bucket[128];
   char s3accesskey[128];
   char s3secretkey[128];
+  unsigned char s3sigv4;
+  char s3region[64];
 
+  struct s3sigkey s3sigkey;
+  struct s3endpoint s3endpoints[16]; // s3hosts*s3ports
+  unsigned short num_s3endpoints;
   struct s3connection s3conns[MAX_IO_THREADS]; // max(s3hosts*s3ports, num_io_threads<=MAX_IO_THREADS)
+  unsigned short num_s3conns;
 
   unsigned int s3timeout;
+  unsigned int s3connecttimeout;
+  unsigned int s3dnsttl;
+  unsigned int verify_interval; // s3blkdev-sync
+  unsigned char s3tcpnodelay;
+  unsigned char s3tcpfastopen;
+  unsigned char s3hedgepct;
+  unsigned char s3hedgebudget;
+  struct s3hedge s3hedge;
+  unsigned short s3rangeparts;
   unsigned short num_io_threads;
   unsigned short num_s3fetchers;
+  unsigned short num_uploaders; // s3blkdev-sync
+  unsigned short num_writeback_threads; // s3blkdevd, 0 disables write-back
+  unsigned int writeback_age; // upload chunks dirty for that many seconds
+  unsigned int writeback_dirty; // or while more MiB are dirty, unless 0
+  unsigned short num_codec_threads;
   unsigned short s3_max_reqs_per_conn;
+  unsigned int warmup_rate; // MiB/s fetched after a start, 0 disables
+  unsigned char warmup_max_used; // percent of the cache filled at most
 
-  struct device devs[128];
+  struct device devs[MAX_DEVICES];
   unsigned short num_devices;
+  char casdir[PATH_MAX];
 
   char listen[128];
   char port[8];
@@ -90,15 +318,84 @@ struct config {
 int load_config (char *configfile, struct config *cfg,
                  unsigned int *err_line, char const **errstr);
 int save_pidfile (char *pidfile);
-int set_socket_options (int sock);
+int set_socket_options (int sock, int flags);
 struct s3connection *s3_get_conn (struct config *cfg, unsigned int *conn_num,
                                   char const **errstr);
 void s3_release_conn (struct s3connection *conn);
+void s3_log_stats (struct config *cfg);
 int s3_request (struct config *cfg, struct s3connection *conn,
                 char const **errstr,
                 enum httpverb verb, char *folder, char *filename, void *data,
                 size_t data_len, void *data_md5,
                 unsigned short *code, size_t *contentlen, unsigned char *md5,
                 char *buffer, size_t buflen);
+int s3_get (struct config *cfg, unsigned int *conn_num, char const **errstr,
+            char *folder, char *filename, unsigned short *code,
+            size_t *contentlen, unsigned char *md5, char *buffer,
+            size_t buflen);
+int s3_start_parts_workers (struct config *cfg, char const **errstr);
+int s3_get_parts (struct config *cfg, unsigned int *conn_num,
+                  char const **errstr, char *folder, char *filename,
+                  unsigned short *code, size_t *contentlen,
+                  unsigned char *md5, char *buffer, size_t buflen);
+int codec_by_name (char *name);
+int codec_start_workers (unsigned int num_threads, char const **errstr);
+int chunk_compress (int codec, int level, unsigned char min_saving,
+                    unsigned char *key, const char *devname,
+                    uint64_t chunk_no, char *src, size_t srclen, char *dst,
+                    size_t *dstlen, char const **errstr);
+int chunk_uncompress (unsigned char *key, const char *devname,
+                      uint64_t chunk_no, char *src, size_t srclen,
+                      char *dst, size_t *dstlen, char const **errstr);
+int codec_derive_key (unsigned char *key, char const **errstr);
+size_t chunk_make_ref (char *obj, unsigned char *digest, char *ref);
+int chunk_parse_ref (char *obj, size_t len, unsigned char *digest);
+int cas_hash (char *obj, size_t len, unsigned char *digest, char *hex,
+              char const **errstr);
+void cas_hex (unsigned char *digest, char *hex);
+int cas_load (char *casdir, char *hex, char *buf, size_t buflen,
+              size_t *len, char const **errstr);
+int cas_store (char *casdir, char *hex, char *buf, size_t len,
+               char const **errstr);
+int chunkmap_open (struct device *dev, int daemon, char const **errstr);
+int chunkmap_close (struct device *dev, int daemon, char const **errstr);
+void chunk_path (char *name, int hashed, char *path);
+int chunk_migrate (int dir_fd, struct device *dev, char *name);
+void chunk_touch (struct device *dev, uint64_t chunk_no);
+void chunk_fetched (struct device *dev, uint64_t chunk_no,
+                    unsigned char *md5);
+void chunk_lock (struct device *dev, uint64_t chunk_no, int excl);
+void chunk_downgrade (struct device *dev, uint64_t chunk_no);
+void chunk_unlock (struct device *dev, uint64_t chunk_no, int excl);
+int chunk_lock_sync (struct device *dev, uint64_t chunk_no, int excl);
+void chunk_unlock_sync (struct device *dev, uint64_t chunk_no, int excl,
+                        int fd);
+int slots_open (struct device *dev, int daemon, char const **errstr);
+void slots_close (struct device *dev);
+int slots_recover (struct device *dev, struct chunkmap *map);
+int64_t slots_alloc (struct device *dev, uint64_t chunk_no);
+int slots_free (struct device *dev, uint64_t chunk_no);
+uint32_t slots_used (struct device *dev);
+int direct_pread (struct device *dev, int fd, void *buf, size_t len,
+                  off_t offs);
+int direct_pwrite (struct device *dev, int fd, const void *buf, size_t len,
+                   off_t offs);
+int slot_fill (struct device *dev, int fd, uint32_t slot, uint64_t chunk_no,
+               const void *buf);
+int manifest_known (struct config *cfg, struct chunkmap_entry *entry,
+                    time_t now);
+int upload_start_workers (struct config *cfg, unsigned int num_threads,
+                          unsigned int conn_num, char const **errstr);
+void upload_chunk (struct device *dev, char *name, enum eviction_mode evict);
+void upload_wait ();
+struct uploader *upload_prewarmer (struct config *cfg, unsigned int conn_num,
+                                   char const **errstr);
+void upload_prewarmer_free (struct uploader *up);
+void upload_prewarm (struct uploader *up, struct device *dev, char *name);
+int heat_save (struct device *dev, char const **errstr);
+int heat_restore (struct device *dev, struct heat_entry **missing,
+                  size_t *num_missing, char const **errstr);
+
+extern int upload_stderr;
 
 #endif
@@ -19,6 +19,7 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/statfs.h>
 #include <gnutls/gnutls.h>
 #include <pthread.h>
 #include <time.h>
@@ -52,6 +53,9 @@
 #define NBD_CMD_DISC 2
 #define NBD_CMD_FLUSH 3
 #define GEOM_MAGIC "GEOM_GATE       "
+#define SEQ_SLACK (1024 * 1024)
+#define SEQ_MIN_LEN (1024 * 1024)
+#define SLOT_FETCH_TRIES 10 // a second apart, then the request fails
 
 const char const NBD_INIT_PASSWD[] = { 'N','B','D','M','A','G','I','C' };
 const char const NBD_OPTS_MAGIC[] =  { 'I','H','A','V','E','O','P','T' };
@@ -75,8 +79,10 @@ struct io_thread_arg {
   int busy;
   int socket;
   pthread_mutex_t *socket_mtx;
-  char *devicename;
+  struct device *dev;
   int cachedir_fd;
+  unsigned int conn_num;
+  int sequential;
   struct __attribute__((packed)) {
     uint32_t magic;
     uint32_t type;
@@ -88,7 +94,17 @@ struct io_thread_arg {
   void *buffer;
 };
 
+struct dirty_chunk {
+  time_t dirtied;
+  struct device *dev;
+  uint64_t chunk_no;
+  uint32_t gen;
+  char name[17];
+};
+
 int running = 1;
+int show_stats = 0;
+static uint64_t chunks_dirtied; // clean chunks written to, for write-back
 struct io_thread_arg io_threads[MAX_IO_THREADS];
 struct config cfg;
 
@@ -203,63 +219,132 @@ ERROR:
 }
 #endif
 
-static int fetch_chunk (char *devicename, int fd, char *name)
+/* md5 is left alone if S3 sends no ETag */
+static int fetch_object (struct io_thread_arg *arg, char *folder, char *name,
+                         unsigned short *code, size_t *contentlen,
+                         unsigned char *md5, char *buf, size_t buflen)
 {
-  int result = -1, res;
-  unsigned int conn_num;
-  char uncompbuf[CHUNKSIZE], compbuf[COMPR_CHUNKSIZE];
   const char *err_str;
-  struct s3connection *s3conn;
+  int res;
+
+  /* large sequential reads want the chunk as fast as possible */
+  if (arg->sequential && (cfg.s3rangeparts > 1))
+    res = s3_get_parts(&cfg, &arg->conn_num, &err_str, folder, name, code,
+                       contentlen, md5, buf, buflen);
+  else
+    res = s3_get(&cfg, &arg->conn_num, &err_str, folder, name, code,
+                 contentlen, md5, buf, buflen);
+  if (res != 0) {
+    logerr("s3_get(): %s/%s/%s: %s", cfg.s3bucket, folder, name, err_str);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* fetch the content-addressed object a reference object points to,
+   preferably from the local copy in casdir */
+static int fetch_cas_object (struct io_thread_arg *arg, unsigned char *digest,
+                             size_t *contentlen, char *buf, size_t buflen)
+{
+  char hex[CAS_HEX_SIZE];
+  const char *err_str;
   unsigned char md5[16];
   unsigned short code;
-  size_t uncomplen, contentlen;
+  int res = 1;
 
-  s3conn = s3_get_conn(&cfg, &conn_num, &err_str);
-  if (s3conn == NULL) {
-    logerr("s3_get_conn(): %s", err_str);
-    goto ERROR;
+  cas_hex(digest, hex);
+
+  if (cfg.casdir[0] != '\0') {
+    res = cas_load(cfg.casdir, hex, buf, buflen, contentlen, &err_str);
+    if (res < 0)
+      logerr("cas_load(): %s/%s: %s", cfg.casdir, hex, err_str);
   }
 
-  res = s3_request(&cfg, s3conn, &err_str, GET, devicename, name,
-                   NULL, 0, NULL, &code, &contentlen, md5,
-                   compbuf, sizeof(compbuf));
-  if (res != 0) {
-    logerr("s3_request(): %s/%s/%s/%s: %s", s3conn->host, s3conn->bucket,
-           devicename, name, err_str);
-    goto ERROR1;
+  if (res == 0)
+    return 0;
+
+  if (fetch_object(arg, CAS_FOLDER, hex, &code, contentlen, md5, buf,
+                   buflen) != 0)
+    return -1;
+
+  if (code != 200) {
+    logerr("s3_get(): %s/%s/%s: HTTP status %hu", cfg.s3bucket, CAS_FOLDER,
+           hex, code);
+    return -1;
   }
 
+  if ((cfg.casdir[0] != '\0') &&
+      (cas_store(cfg.casdir, hex, buf, *contentlen, &err_str) != 0))
+    logerr("cas_store(): %s/%s: %s", cfg.casdir, hex, err_str);
+
+  return 0;
+}
+
+/* into the chunk file fd, or into slot of the cachefile fd if >= 0.
+   uncompbuf is aligned for O_DIRECT to either */
+static int fetch_chunk (struct io_thread_arg *arg, int fd, char *name,
+                        uint64_t chunk_no, int64_t slot)
+{
+  int result = -1, res;
+  char uncompbuf[CHUNKSIZE] __attribute__((aligned(DIRECT_ALIGN)));
+  char compbuf[COMPR_CHUNKSIZE];
+  char *devicename = arg->dev->name;
+  const char *err_str;
+  unsigned char digest[CAS_DIGEST_SIZE], md5[16];
+  unsigned short code;
+  size_t uncomplen, contentlen;
+
+  memset(md5, 0, sizeof(md5));
+  if (fetch_object(arg, devicename, name, &code, &contentlen, md5, compbuf,
+                   sizeof(compbuf)) != 0)
+    goto ERROR;
+
+  if ((code == 200) && chunk_parse_ref(compbuf, contentlen, digest) &&
+      (fetch_cas_object(arg, digest, &contentlen, compbuf,
+                        sizeof(compbuf)) != 0))
+    goto ERROR;
+
   if (code == 200) {
     uncomplen = sizeof(uncompbuf);
-    res = snappy_uncompress(compbuf, contentlen, uncompbuf, &uncomplen);
-    if (res != SNAPPY_OK) {
-      logerr("snappy_uncompress(): %s/%s/%s/%s: res=%i contentlen=%lu "
-             "uncompressed=%lu",
-             s3conn->host, s3conn->bucket, devicename, name, res, contentlen,
-             uncomplen);
-      goto ERROR1;
+    res = chunk_uncompress((arg->dev->encrypt ? arg->dev->key : NULL),
+                           devicename, chunk_no, compbuf, contentlen,
+                           uncompbuf, &uncomplen, &err_str);
+    if (res < 0) {
+      logerr("chunk_uncompress(): %s/%s/%s: %s contentlen=%lu",
+             cfg.s3bucket, devicename, name, err_str, contentlen);
+      goto ERROR;
     }
     if (uncomplen != CHUNKSIZE) {
-      logerr("snappy_uncompress(): %s/%s/%s/%s: uncomplen %lu, expected %u",
-             s3conn->host, s3conn->bucket, devicename, name, uncomplen,
-             CHUNKSIZE);
-      goto ERROR1;
+      logerr("chunk_uncompress(): %s/%s/%s: uncomplen %lu, expected %u",
+             cfg.s3bucket, devicename, name, uncomplen, CHUNKSIZE);
+      goto ERROR;
     }
+
+    __sync_fetch_and_add(&arg->dev->chunks_coded, 1);
+    if (res == CODEC_NONE)
+      __sync_fetch_and_add(&arg->dev->chunks_raw, 1);
   } else if (code == 404) {
     memset(uncompbuf, 0, sizeof(uncompbuf));
   } else {
-    logerr("s3_request(): %s/%s/%s/%s: HTTP status %hu", s3conn->host,
-            s3conn->bucket, devicename, name, code);
-    goto ERROR1;
+    logerr("s3_get(): %s/%s/%s: HTTP status %hu", cfg.s3bucket, devicename,
+           name, code);
+    goto ERROR;
   }
 
-  if (write_all(fd, uncompbuf, CHUNKSIZE) != 0)
-    goto ERROR1;
+  if (slot >= 0) {
+    if (slot_fill(arg->dev, fd, slot, chunk_no, uncompbuf) != 0) {
+      logerr("slot_fill(): %s: %s", arg->dev->cachefile, strerror(errno));
+      goto ERROR;
+    }
+  } else if (write_all(fd, uncompbuf, CHUNKSIZE) != 0) {
+    goto ERROR;
+  }
 
-  result = 0;
+  if (code == 200)
+    chunk_fetched(arg->dev, chunk_no, md5);
 
-ERROR1:
-  s3_release_conn(s3conn);
+  result = 0;
 
 ERROR:
   return result;
@@ -326,107 +411,64 @@ static int io_send_reply (struct io_thread_arg *arg, uint32_t error,
   return 0;
 }
 
-static int io_lock_chunk (int fd, short int type, uint64_t start_offs,
-                          uint64_t end_offs)
-{
-  struct flock flk;
-
-  flk.l_type = type;
-  flk.l_whence = SEEK_SET;
-  flk.l_start = start_offs;
-  flk.l_len = end_offs - start_offs;
-  flk.l_pid = 0;
-
-  if (fcntl(fd, F_OFD_SETLKW, &flk) != 0) {
-    logerr("fcntl(): %s", strerror(errno));
-    return -1;
-  }
-
-  return 0;
-}
-
+/* open a chunk, fetched first unless complete, and lock it shared in the
+   chunk map until io_close_chunk(). the lock takes no system call unless
+   contended */
 static int io_open_chunk (struct io_thread_arg *arg, uint64_t chunk_no,
-                          uint64_t start_offs, uint64_t end_offs)
+                          uint64_t start_offs)
 {
-  char name[17];
-  int fd;
-  struct stat st, st0;
+  char name[17], path[CHUNK_PATH_SIZE];
+  int fd, excl, flags = O_RDWR | (arg->dev->direct ? O_DIRECT : 0);
+  struct stat st;
   struct timespec cooldown;
 
   snprintf(name, sizeof(name), "%016llx", (unsigned long long) chunk_no);
-
-  for (;;) {
-    fd = openat(arg->cachedir_fd, name, O_RDWR|O_CREAT,
-                S_IRUSR|S_IWUSR|S_IRGRP);
-    if (fd < 0) {
-      logerr("openat(): %s", strerror(errno));
-      goto ERROR;
-    }
-
-    if (io_lock_chunk(fd, F_RDLCK, start_offs, end_offs) != 0)
-      goto ERROR1;
-
-    if (fstatat(arg->cachedir_fd, name, &st0, 0) != 0) {
-      if (errno != ENOENT) {
-        logerr("fstatat(): %s", strerror(errno));
-        goto ERROR1;
-      }
-
-      if (close(fd) != 0) {
-        logerr("close(): %s", strerror(errno));
+  chunk_path(name, arg->dev->hashed, path);
+
+  /* only whoever fetches the chunk locks it exclusive */
+  for (excl = 0;; excl = 1) {
+    chunk_lock(arg->dev, chunk_no, excl);
+
+    fd = openat(arg->cachedir_fd, path, flags);
+    if ((fd < 0) && (errno == ENOENT)) {
+      /* the chunk may still be in the other layout, and must not be
+         fetched anew then */
+      if (chunk_migrate(arg->cachedir_fd, arg->dev, name) < 0) {
+        logerr("chunk_migrate(): %s/%s: %s", arg->dev->cachedir, name,
+               strerror(errno));
         goto ERROR;
       }
 
+      fd = openat(arg->cachedir_fd, path, flags | (excl ? O_CREAT : 0),
+                  S_IRUSR|S_IWUSR|S_IRGRP);
+    }
+
+    if ((fd < 0) && (errno == ENOENT) && !excl) {
+      chunk_unlock(arg->dev, chunk_no, 0);
       continue;
     }
 
-    if (fstat(fd, &st) != 0) {
-      logerr("fstat(): %s", strerror(errno));
-      goto ERROR1;
+    if (fd < 0) {
+      logerr("openat(): %s", strerror(errno));
+      goto ERROR;
     }
 
-    if (st.st_ino != st0.st_ino) {
-      /* the file we opened and the current file on disk are not the same */
+    if (fstat(fd, &st) != 0) {
+      logerr("fstat(): %s", strerror(errno));
       goto ERROR1;
     }
 
     if (st.st_size == CHUNKSIZE)
       break;
 
-    if (io_lock_chunk(fd, F_UNLCK, start_offs, end_offs) != 0)
-      goto ERROR1;
-
-    if (io_lock_chunk(fd, F_WRLCK, 0, CHUNKSIZE) != 0)
-      goto ERROR1;
-
-    if (fstatat(arg->cachedir_fd, name, &st0, 0) != 0) {
-      if (errno != ENOENT) {
-        logerr("fstatat(): %s", strerror(errno));
-        goto ERROR1;
-      }
-
-      if (close(fd) != 0) {
+    if (!excl) {
+      if (close(fd) != 0)
         logerr("close(): %s", strerror(errno));
-        goto ERROR;
-      }
-
+      chunk_unlock(arg->dev, chunk_no, 0);
       continue;
     }
 
-    if (fstat(fd, &st) != 0) {
-      logerr("fstat(): %s", strerror(errno));
-      goto ERROR1;
-    }
-
-    if (st.st_ino != st0.st_ino) {
-      /* the file we opened and the current file on disk are not the same */
-      goto ERROR1;
-    }
-
-    if (st.st_size == CHUNKSIZE)
-      break;
-
-    while (fetch_chunk(arg->devicename, fd, name) != 0) {
+    while (fetch_chunk(arg, fd, name, chunk_no, -1) != 0) {
       if (lseek(fd, 0, SEEK_SET) == (off_t) -1) {
         logerr("lseek(): %s", strerror(errno));
         goto ERROR1;
@@ -441,6 +483,10 @@ static int io_open_chunk (struct io_thread_arg *arg, uint64_t chunk_no,
     break;
   }
 
+  if (excl)
+    chunk_downgrade(arg->dev, chunk_no);
+  excl = 0;
+
   if (lseek(fd, start_offs, SEEK_SET) == (off_t) -1) {
     logerr("lseek(): %s", strerror(errno));
     goto ERROR1;
@@ -453,39 +499,156 @@ ERROR1:
     logerr("close(): %s", strerror(errno));
 
 ERROR:
+  chunk_unlock(arg->dev, chunk_no, excl);
   return -1;
 }
 
+/* like io_open_chunk(), for a device caching chunks in slots. returns the
+   cachefile, shared by all threads, and where the requested part of the
+   chunk is in it */
+static int io_open_slot (struct io_thread_arg *arg, uint64_t chunk_no,
+                         uint64_t start_offs, off_t *offs)
+{
+  struct device *dev = arg->dev;
+  struct chunkmap_entry *entry = &dev->chunkmap->entries[chunk_no];
+  struct timespec cooldown;
+  char name[17];
+  int64_t slot;
+  int excl, tries;
+
+  snprintf(name, sizeof(name), "%016llx", (unsigned long long) chunk_no);
+
+  for (excl = 0;; excl = 1) {
+    chunk_lock(dev, chunk_no, excl);
+
+    if (entry->flags & CHUNK_CACHED)
+      break;
+
+    if (!excl) {
+      chunk_unlock(dev, chunk_no, 0);
+      continue;
+    }
+
+    /* a slot may be left from a failed fetch */
+    slot = (int64_t) entry->slot - 1;
+    if (slot < 0) {
+      slot = slots_alloc(dev, chunk_no);
+      if (slot < 0) {
+        logerr("slots_alloc(): %s: %s", dev->cachefile, strerror(errno));
+        chunk_unlock(dev, chunk_no, 1);
+        return -1;
+      }
+      entry->slot = slot + 1;
+    }
+
+    /* the chunk stays locked meanwhile, so give up eventually; the slot
+       is kept for the next attempt */
+    for (tries = 1;
+         fetch_chunk(arg, dev->cachefile_fd, name, chunk_no, slot) != 0;
+         tries++) {
+      if (tries >= SLOT_FETCH_TRIES) {
+        logerr("giving up on %s/%s after %i tries", dev->name, name, tries);
+        chunk_unlock(dev, chunk_no, 1);
+        return -1;
+      }
+
+      cooldown.tv_sec = 1;
+      cooldown.tv_nsec = 0;
+      nanosleep(&cooldown, NULL);
+    }
+
+    __sync_fetch_and_or(&entry->flags, CHUNK_CACHED);
+
+    break;
+  }
+
+  if (excl)
+    chunk_downgrade(dev, chunk_no);
+
+  *offs = SLOT_DATA(entry->slot - 1) + start_offs;
+
+  return dev->cachefile_fd;
+}
+
+static void io_close_chunk (struct io_thread_arg *arg, uint64_t chunk_no,
+                            int fd)
+{
+  if ((arg->dev->num_slots == 0) && (close(fd) != 0))
+    logerr("close(): %s", strerror(errno));
+
+  chunk_unlock(arg->dev, chunk_no, 0);
+}
+
 static int io_read_chunk (struct io_thread_arg *arg, uint64_t chunk_no,
                           uint64_t start_offs, uint64_t end_offs,
                           uint32_t *pos)
 {
   int fd, result = -1;
   int64_t len = end_offs - start_offs;
+  off_t offs = start_offs;
 
-  fd = io_open_chunk(arg, chunk_no, start_offs, end_offs);
+  /* a request ending at a chunk boundary */
+  if (len == 0)
+    return 0;
+
+  if (arg->dev->num_slots > 0)
+    fd = io_open_slot(arg, chunk_no, start_offs, &offs);
+  else
+    fd = io_open_chunk(arg, chunk_no, start_offs);
   if (fd < 0)
     goto ERROR;
 
-  if (read_all(fd, arg->buffer + *pos, len) != 0)
+  if ((arg->dev->num_slots > 0) || arg->dev->direct) {
+    if (direct_pread(arg->dev, fd, arg->buffer + *pos, len, offs) != 0) {
+      logerr("pread(): %s", strerror(errno));
+      goto ERROR1;
+    }
+  } else if (read_all(fd, arg->buffer + *pos, len) != 0) {
     goto ERROR1;
+  }
+
+  chunk_touch(arg->dev, chunk_no);
 
   *pos += len;
 
   result = 0;
 
 ERROR1:
-  if (close(fd) != 0)
-    logerr("close(): %s", strerror(errno));
+  io_close_chunk(arg, chunk_no, fd);
 
 ERROR:
   return result;
 }
 
+/* a request must lie within the device, the chunk map has no entries for
+   chunks beyond it */
+static int io_valid_request (struct io_thread_arg *arg)
+{
+  return ((arg->req.len <= arg->dev->size) &&
+          (arg->req.offs <= arg->dev->size - arg->req.len));
+}
+
 static int io_read_chunks (struct io_thread_arg *arg)
 {
   uint64_t start_chunk, end_chunk, start_offs, end_offs;
   uint32_t pos = 0;
+  struct device *dev = arg->dev;
+
+  if (!io_valid_request(arg)) {
+    io_send_reply(arg, EINVAL, 0);
+    return -1;
+  }
+
+  /* reads continuing the previous one (give or take some reordering by the
+     client) form a sequential stream; not locked, as it is just a hint */
+  if ((arg->req.offs + SEQ_SLACK >= dev->seq_next) &&
+      (arg->req.offs <= dev->seq_next + SEQ_SLACK))
+    dev->seq_len += arg->req.len;
+  else
+    dev->seq_len = arg->req.len;
+
+  dev->seq_next = arg->req.offs + arg->req.len;
+  arg->sequential = (dev->seq_len >= SEQ_MIN_LEN);
 
   start_chunk = arg->req.offs / CHUNKSIZE;
   end_chunk = (arg->req.offs + arg->req.len) / CHUNKSIZE;
@@ -515,21 +678,49 @@ static int io_write_chunk (struct io_thread_arg *arg, uint64_t chunk_no,
 {
   int fd, result = -1;
   int64_t len = end_offs - start_offs;
+  struct chunkmap *map = arg->dev->chunkmap;
+  struct chunkmap_entry *entry;
+  off_t offs = start_offs;
 
-  fd = io_open_chunk(arg, chunk_no, start_offs, end_offs);
+  /* a request ending at a chunk boundary */
+  if (len == 0)
+    return 0;
+
+  if (arg->dev->num_slots > 0)
+    fd = io_open_slot(arg, chunk_no, start_offs, &offs);
+  else
+    fd = io_open_chunk(arg, chunk_no, start_offs);
   if (fd < 0)
     goto ERROR;
 
-  if (write_all(fd, arg->buffer + *pos, len) != 0)
+  if ((arg->dev->num_slots > 0) || arg->dev->direct) {
+    if (direct_pwrite(arg->dev, fd, arg->buffer + *pos, len, offs) != 0) {
+      logerr("pwrite(): %s", strerror(errno));
+      goto ERROR1;
+    }
+  } else if (write_all(fd, arg->buffer + *pos, len) != 0) {
     goto ERROR1;
+  }
+
+  /* flagged as cached before dirty, so whoever sees it dirty finds it */
+  chunk_touch(arg->dev, chunk_no);
+
+  /* let s3blkdev-sync and write-back know the chunk is dirty, and since
+     when */
+  if ((map != NULL) && (chunk_no < map->num_chunks)) {
+    entry = &map->entries[chunk_no];
+    if (__sync_fetch_and_add(&entry->gen, 1) == entry->synced_gen) {
+      entry->dirtied = time(NULL);
+      __sync_fetch_and_add(&chunks_dirtied, 1);
+    }
+  }
 
   *pos += len;
 
   result = 0;
 
 ERROR1:
-  if (close(fd) != 0)
-    logerr("close(): %s", strerror(errno));
+  io_close_chunk(arg, chunk_no, fd);
 
 ERROR:
   return result;
@@ -540,6 +731,13 @@ static int io_write_chunks (struct io_thread_arg *arg)
   uint64_t start_chunk, end_chunk, start_offs, end_offs;
   uint32_t pos = 0;
 
+  arg->sequential = 0;
+
+  if (!io_valid_request(arg)) {
+    io_send_reply(arg, EINVAL, 0);
+    return -1;
+  }
+
   start_chunk = arg->req.offs / CHUNKSIZE;
   end_chunk = (arg->req.offs + arg->req.len) / CHUNKSIZE;
   start_offs = arg->req.offs % CHUNKSIZE;
@@ -611,7 +809,9 @@ static void *io_worker (void *arg0)
         io_write_chunks(arg);
         break;
       case NBD_CMD_FLUSH:
-        if (syncfs(arg->cachedir_fd) == 0)
+        if ((syncfs(arg->cachedir_fd) == 0) &&
+            ((arg->dev->num_slots == 0) ||
+             (fdatasync(arg->dev->cachefile_fd) == 0)))
           io_send_reply(arg, 0, 0);
         else {
           logerr("syncfs(): %s", strerror(errno));
@@ -923,11 +1123,13 @@ static int client_worker_loop (struct client_thread_arg *arg)
 
   slot->req.len = ntohl(slot->req.len);
   if (slot->req.len > slot->buflen) {
+    /* aligned, so O_DIRECT needs no bounce buffer for aligned requests */
+    free(slot->buffer);
     slot->buflen = slot->req.len;
-    slot->buffer = realloc(slot->buffer, slot->buflen);
-
-    if (slot->buffer == NULL) {
-      logerr("%s", "realloc() failed");
+    if (posix_memalign(&slot->buffer, DIRECT_ALIGN, slot->buflen) != 0) {
+      logerr("%s", "posix_memalign() failed");
+      slot->buffer = NULL;
+      slot->buflen = 0;
       goto ERROR1;
     }
   }
@@ -949,7 +1151,7 @@ static int client_worker_loop (struct client_thread_arg *arg)
 
   slot->socket = arg->socket;
   slot->socket_mtx = &arg->socket_mtx;
-  slot->devicename = arg->dev->name;
+  slot->dev = arg->dev;
   slot->cachedir_fd = arg->cachedir_fd;
 
   if ((res = pthread_cond_signal(&slot->wakeup_cond)) != 0) {
@@ -985,7 +1187,7 @@ static void *client_worker (void *arg0)
 
   client_address(arg);
 
-  if (set_socket_options(arg->socket) != 0) {
+  if (set_socket_options(arg->socket, 0) != 0) {
     logerr("setsockopt(): %s", strerror(res));
     goto ERROR;
   }
@@ -1154,7 +1356,7 @@ static void *geom_client_worker (void *arg0)
 
   client_address(arg);
 
-  if (set_socket_options(arg->socket) != 0) {
+  if (set_socket_options(arg->socket, 0) != 0) {
     logerr("setsockopt(): %s", strerror(res));
     goto ERROR;
   }
@@ -1205,6 +1407,11 @@ static void sigterm_handler (int sig __attribute__((unused)))
   running = 0;
 }
 
+static void sigusr1_handler (int sig __attribute__((unused)))
+{
+  show_stats = 1;
+}
+
 static void setup_signal (int sig, void (*handler)(int))
 {
   struct sigaction sa;
@@ -1225,10 +1432,14 @@ static void setup_signals ()
   if (sigdelset(&sigset, SIGTERM) != 0)
     err(1, "sigdelset()");
 
+  if (sigdelset(&sigset, SIGUSR1) != 0)
+    err(1, "sigdelset()");
+
   if (pthread_sigmask(SIG_SETMASK, &sigset, NULL) != 0)
     err(1, "pthread_sigmask()");
 
   setup_signal(SIGTERM, sigterm_handler);
+  setup_signal(SIGUSR1, sigusr1_handler);
 }
 
 static int create_listen_socket_inet (char *ip, char *port)
@@ -1307,6 +1518,8 @@ static void show_help ()
 "                      " DEFAULT_CONFIGFILE "\n"
 "  -p <pid file>       daemonize and save pid to this file\n"
 "  -h                  show this help ;-)\n"
+"\n"
+"Send SIGUSR1 to log statistics of each S3 endpoint.\n"
 );
 }
 
@@ -1324,11 +1537,11 @@ static void launch_io_workers ()
 
   for (i = 0; i < cfg.num_io_threads; i++) {
     io_threads[i].busy = 1;
+    io_threads[i].conn_num = i;
     io_threads[i].buflen = 1024 * 1024;
-    io_threads[i].buffer = malloc(io_threads[i].buflen);
-
-    if (io_threads[i].buffer == NULL)
-      errx(1, "malloc() failed");
+    if (posix_memalign(&io_threads[i].buffer, DIRECT_ALIGN,
+                       io_threads[i].buflen) != 0)
+      errx(1, "posix_memalign() failed");
 
     if ((res = pthread_cond_init(&io_threads[i].wakeup_cond, NULL)) != 0)
       errx(1, "pthread_cond_init(): %s", strerror(res));
@@ -1370,6 +1583,312 @@ static void join_io_workers ()
   }
 }
 
+static int compare_dirtied (const void *a0, const void *b0)
+{
+  const struct dirty_chunk *a = a0, *b = b0;
+
+  return (a->dirtied > b->dirtied) - (a->dirtied < b->dirtied);
+}
+
+/* collect the dirty chunks of all devices, oldest first */
+static int writeback_collect (struct dirty_chunk **chunks, size_t *num_chunks,
+                              size_t *size_chunks)
+{
+  struct chunkmap_entry *entry;
+  struct dirty_chunk *grown;
+  struct device *dev;
+  unsigned int devnum;
+  uint64_t i;
+  uint32_t gen;
+
+  for (*num_chunks = 0, devnum = 0; devnum < cfg.num_devices; devnum++) {
+    dev = &cfg.devs[devnum];
+
+    for (i = 0; i < dev->chunkmap->num_chunks; i++) {
+      entry = &dev->chunkmap->entries[i];
+      gen = entry->gen;
+      if (gen == entry->synced_gen)
+        continue;
+
+      if (*num_chunks >= *size_chunks) {
+        grown = realloc(*chunks, sizeof(grown[0]) * (*size_chunks * 2 + 1024));
+        if (grown == NULL) {
+          logerr("%s", "realloc() failed");
+          return -1;
+        }
+        *chunks = grown;
+        *size_chunks = *size_chunks * 2 + 1024;
+      }
+
+      (*chunks)[*num_chunks].dirtied = entry->dirtied;
+      (*chunks)[*num_chunks].dev = dev;
+      (*chunks)[*num_chunks].chunk_no = i;
+      (*chunks)[*num_chunks].gen = gen;
+      snprintf((*chunks)[*num_chunks].name, sizeof((*chunks)[0].name),
+               "%016llx", (unsigned long long) i);
+
+      *num_chunks += 1;
+    }
+  }
+
+  qsort(*chunks, *num_chunks, sizeof((*chunks)[0]), compare_dirtied);
+
+  return 0;
+}
+
+/* drop the chunks of the last collection which were uploaded since, by
+   write-back or by s3blkdev-sync. the others keep their place, unless an
+   upload they were written to during restamped them */
+static void writeback_prune (struct dirty_chunk *chunks, size_t *num_chunks)
+{
+  struct chunkmap_entry *entry;
+  size_t i, n;
+  uint32_t gen;
+  int restamped = 0;
+
+  for (i = n = 0; i < *num_chunks; i++) {
+    entry = &chunks[i].dev->chunkmap->entries[chunks[i].chunk_no];
+    gen = entry->gen;
+    if (gen == entry->synced_gen)
+      continue;
+
+    chunks[n] = chunks[i];
+    chunks[n].gen = gen;
+    if (chunks[n].dirtied != entry->dirtied) {
+      chunks[n].dirtied = entry->dirtied;
+      restamped = 1;
+    }
+    n++;
+  }
+
+  *num_chunks = n;
+
+  if (restamped)
+    qsort(chunks, n, sizeof(chunks[0]), compare_dirtied);
+}
+
+/* each second, upload the chunks dirty for writeback_age seconds, and the
+   oldest ones while more than writeback_dirty MiB are dirty. however often
+   a chunk is written to, it is uploaded at most once per round. the chunk
+   maps are only scanned again after clean chunks were written to, until
+   then the chunks dirty before suffice */
+static void *writeback_worker (void *arg __attribute__((unused)))
+{
+  struct dirty_chunk *chunks = NULL;
+  struct chunkmap_entry *entry;
+  size_t num_chunks = 0, size_chunks = 0, i;
+  uint64_t dirty_mb, dirtied, collected = 0;
+  time_t now;
+  int res, collect = 1;
+
+  if (block_signals() != 0)
+    goto ERROR;
+
+  if ((res = pthread_setname_np(pthread_self(), "s3blkdevd:wb")) != 0) {
+    logerr("pthread_setname_np(): %s", strerror(res));
+    goto ERROR;
+  }
+
+  while (running) {
+    sleep(1);
+
+    /* those written to while collecting count for the next round */
+    dirtied = chunks_dirtied;
+    if (collect || (dirtied != collected)) {
+      if (writeback_collect(&chunks, &num_chunks, &size_chunks) != 0) {
+        collect = 1;
+        continue;
+      }
+      collect = 0;
+      collected = dirtied;
+    } else {
+      writeback_prune(chunks, &num_chunks);
+    }
+
+    now = time(NULL);
+    dirty_mb = (uint64_t) num_chunks * (CHUNKSIZE / (1024 * 1024));
+
+    for (i = 0; (i < num_chunks) && running; i++) {
+      if ((now - chunks[i].dirtied < cfg.writeback_age) &&
+          ((cfg.writeback_dirty == 0) || (dirty_mb <= cfg.writeback_dirty)))
+        break;
+
+      /* chunks marked dirty after a crash need not be cached at all */
+      entry = &chunks[i].dev->chunkmap->entries[chunks[i].chunk_no];
+      if (entry->flags & CHUNK_CACHED)
+        upload_chunk(chunks[i].dev, chunks[i].name, SYNC_ONLY);
+      else
+        entry->synced_gen = chunks[i].gen;
+
+      dirty_mb -= CHUNKSIZE / (1024 * 1024);
+    }
+
+    upload_wait();
+  }
+
+ERROR:
+  free(chunks);
+  return NULL;
+}
+
+static void heat_save_all ()
+{
+  const char *errstr;
+  unsigned int i;
+
+  for (i = 0; i < cfg.num_devices; i++) {
+    if (heat_save(&cfg.devs[i], &errstr) != 0)
+      logerr("heat_save(): %s: %s", cfg.devs[i].heatfile, errstr);
+  }
+}
+
+/* whether the cache of dev is filled to warmup_max_used percent, of its
+   slots, or of the space or inodes of the filesystem of cachedir */
+static int warmup_full (struct device *dev)
+{
+  struct statfs fs;
+  unsigned int max = cfg.warmup_max_used;
+  uint64_t used;
+
+  if (dev->num_slots > 0)
+    return ((uint64_t) slots_used(dev) * 100 >=
+            (uint64_t) dev->num_slots * max);
+
+  if (statfs(dev->cachedir, &fs) != 0) {
+    logerr("statfs(): %s: %s", dev->cachedir, strerror(errno));
+    return 1;
+  }
+
+  /* like df(1), space reserved for root is neither used nor free */
+  used = fs.f_blocks - fs.f_bfree;
+  if ((used + fs.f_bavail > 0) && (used * 100 >= (used + fs.f_bavail) * max))
+    return 1;
+
+  return ((fs.f_files > 0) &&
+          ((fs.f_files - fs.f_ffree) * 100 >= fs.f_files * max));
+}
+
+/* sleep until fetching bytes since start keeps to warmup_rate */
+static void warmup_throttle (struct timespec *start, unsigned long long bytes)
+{
+  struct timespec now;
+  double ahead;
+
+  while (running) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ahead = (double) bytes / ((double) cfg.warmup_rate * 1024 * 1024) -
+            (now.tv_sec - start->tv_sec) -
+            (now.tv_nsec - start->tv_nsec) / 1e9;
+    if (ahead <= 0)
+      break;
+    usleep(MIN(ahead, 1.0) * 1e6);
+  }
+}
+
+/* carry the heat maps over into the chunk maps, warm the cache up with the
+   chunks missing from it, one device after the other, then save the heat
+   maps every HEAT_SAVE_INTERVAL seconds. all heat maps are carried over
+   first, saving them during the warm-up must not lose those of devices
+   not warmed up yet */
+static void *heat_worker (void *arg __attribute__((unused)))
+{
+  struct heat_entry **missing;
+  struct uploader *up = NULL;
+  struct timespec start;
+  struct device *dev;
+  size_t *num_missing, i;
+  unsigned long long fetched = 0, bytes;
+  unsigned long chunks;
+  unsigned int devnum;
+  const char *errstr;
+  char name[17];
+  time_t saved;
+  int res;
+
+  if (block_signals() != 0)
+    return NULL;
+
+  if ((res = pthread_setname_np(pthread_self(), "s3blkdevd:heat")) != 0) {
+    logerr("pthread_setname_np(): %s", strerror(res));
+    return NULL;
+  }
+
+  if (cfg.warmup_rate > 0) {
+    up = upload_prewarmer(&cfg, cfg.num_io_threads + cfg.num_writeback_threads,
+                          &errstr);
+    if (up == NULL)
+      logerr("upload_prewarmer(): %s", errstr);
+  }
+
+  missing = calloc(cfg.num_devices, sizeof(missing[0]));
+  num_missing = calloc(cfg.num_devices, sizeof(num_missing[0]));
+  if ((missing == NULL) || (num_missing == NULL)) {
+    logerr("calloc() failed");
+    free(missing);
+    free(num_missing);
+    upload_prewarmer_free(up);
+    return NULL;
+  }
+
+  for (devnum = 0; devnum < cfg.num_devices; devnum++) {
+    dev = &cfg.devs[devnum];
+
+    if (heat_restore(dev, &missing[devnum], &num_missing[devnum],
+                     &errstr) != 0)
+      logerr("heat_restore(): %s: %s", dev->heatfile, errstr);
+  }
+
+  saved = time(NULL);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (devnum = 0; (devnum < cfg.num_devices) && running; devnum++) {
+    dev = &cfg.devs[devnum];
+    chunks = dev->chunks_prewarmed;
+
+    for (i = 0; (up != NULL) && (i < num_missing[devnum]) && running; i++) {
+      /* a full cache would evict what was just fetched, or fail fetches
+         for clients */
+      if (warmup_full(dev))
+        break;
+
+      snprintf(name, sizeof(name), "%016llx",
+               (unsigned long long) missing[devnum][i].chunk_no);
+
+      bytes = dev->bytes_prewarmed;
+      upload_prewarm(up, dev, name);
+      fetched += dev->bytes_prewarmed - bytes;
+
+      warmup_throttle(&start, fetched);
+
+      if (time(NULL) - saved >= HEAT_SAVE_INTERVAL) {
+        heat_save_all();
+        saved = time(NULL);
+      }
+    }
+
+    if (i > 0)
+      syslog(LOG_INFO, "warmed up %s: %lu of %zu chunks fetched\n",
+             dev->name, dev->chunks_prewarmed - chunks, num_missing[devnum]);
+  }
+
+  for (devnum = 0; devnum < cfg.num_devices; devnum++)
+    free(missing[devnum]);
+  free(missing);
+  free(num_missing);
+  upload_prewarmer_free(up);
+
+  while (running) {
+    sleep(1);
+
+    if (time(NULL) - saved >= HEAT_SAVE_INTERVAL) {
+      heat_save_all();
+      saved = time(NULL);
+    }
+  }
+
+  return NULL;
+}
+
 static void increase_stacksize ()
 {
   struct rlimit rl;
@@ -1432,8 +1951,10 @@ int main (int argc, char **argv)
   char *configfile = DEFAULT_CONFIGFILE, *pidfile = NULL;
   const char *errstr;
   int foreground = 1, listen_socket = -1, geom_listen_socket = -1, res;
-  unsigned int errline;
+  unsigned int errline, i;
   pthread_attr_t thread_attr;
+  pthread_t writeback_thread, heat_thread;
+  int heat = 0;
   fd_set rfds;
 
   while ((res = getopt(argc, argv, "c:hp:")) != -1) {
@@ -1458,10 +1979,41 @@ int main (int argc, char **argv)
   if ((pidfile != NULL) && (save_pidfile(pidfile) != 0))
     err(1, "Cannot save pidfile %s", pidfile);
 
+  for (i = 0; i < cfg.num_devices; i++) {
+    if (chunkmap_open(&cfg.devs[i], 1, &errstr) != 0)
+      errx(1, "chunkmap_open(): %s/%s: %s", cfg.devs[i].cachedir,
+           CHUNKMAP_FILE, errstr);
+  }
+
   increase_stacksize();
   setup_signals();
   launch_io_workers();
 
+  if (codec_start_workers(cfg.num_codec_threads, &errstr) != 0)
+    errx(1, "codec_start_workers(): %s", errstr);
+
+  if (s3_start_parts_workers(&cfg, &errstr) != 0)
+    errx(1, "s3_start_parts_workers(): %s", errstr);
+
+  if (cfg.num_writeback_threads > 0) {
+    if (upload_start_workers(&cfg, cfg.num_writeback_threads,
+                             cfg.num_io_threads, &errstr) != 0)
+      errx(1, "upload_start_workers(): %s", errstr);
+
+    res = pthread_create(&writeback_thread, NULL, &writeback_worker, NULL);
+    if (res != 0)
+      errx(1, "pthread_create(): %s", strerror(res));
+  }
+
+  for (i = 0; i < cfg.num_devices; i++)
+    heat |= (cfg.devs[i].heatfile[0] != '\0');
+
+  if (heat) {
+    res = pthread_create(&heat_thread, NULL, &heat_worker, NULL);
+    if (res != 0)
+      errx(1, "pthread_create(): %s", strerror(res));
+  }
+
   if ((res = pthread_attr_init(&thread_attr)) != 0)
     errx(1, "pthread_attr_init(): %s", strerror(res));
   res = pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
@@ -1501,6 +2053,11 @@ int main (int argc, char **argv)
     res = select(MAX(listen_socket, geom_listen_socket) + 1, &rfds, NULL, NULL,
                  NULL);
 
+    if (show_stats) {
+      show_stats = 0;
+      s3_log_stats(&cfg);
+    }
+
     if (res < 0) {
       if (errno == EINTR)
         continue;
@@ -1538,6 +2095,25 @@ int main (int argc, char **argv)
   syslog(LOG_INFO, "waiting for I/O workers...\n");
   join_io_workers();
 
+  if (cfg.num_writeback_threads > 0) {
+    syslog(LOG_INFO, "waiting for write-back...\n");
+    if ((res = pthread_join(writeback_thread, NULL)) != 0)
+      log_error("pthread_join(): %s", strerror(res));
+  }
+
+  if (heat) {
+    syslog(LOG_INFO, "saving heat maps...\n");
+    if ((res = pthread_join(heat_thread, NULL)) != 0)
+      log_error("pthread_join(): %s", strerror(res));
+    heat_save_all();
+  }
+
+  for (i = 0; i < cfg.num_devices; i++) {
+    if (chunkmap_close(&cfg.devs[i], 1, &errstr) != 0)
+      log_error("chunkmap_close(): %s/%s: %s", cfg.devs[i].cachedir,
+                CHUNKMAP_FILE, errstr);
+  }
+
   if ((cfg.listen[0] == '/') && (unlink(cfg.listen) != 0))
     log_error("unlink(): %s: %s", cfg.listen, strerror(errno));
 
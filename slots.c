@@ -0,0 +1,391 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "s3blkdev.h"
+
+/* the slot backend: chunk number n lives in whatever slot the chunk map
+   assigns to it, at SLOT_DATA(slot). s3blkdevd takes a free slot when it
+   fetches a chunk, s3blkdev-sync frees it when evicting the chunk, each
+   with the chunk locked exclusive in the map.
+
+   before a slot gets a new chunk, its header is invalidated; only once the
+   chunk is written completely, the header names it. so after a crash, the
+   headers tell which chunk each slot holds. freeing a slot invalidates
+   its header too, before the slot counts as free: the chunk may be
+   fetched, written to and evicted again elsewhere, and an old header
+   left behind would bring back stale data. a crash between the two
+   leaves a slot nobody owns, not a stale chunk.
+
+   the O_DIRECT I/O here serves chunk files of devices set to direct, too */
+
+static __thread char *bounce;
+static __thread size_t bounce_len;
+
+/* an aligned buffer for the I/O O_DIRECT cannot do in place */
+static char *direct_bounce (size_t len)
+{
+  if (len > bounce_len) {
+    free(bounce);
+    bounce_len = 0;
+    if (posix_memalign((void **) &bounce, DIRECT_ALIGN, len) != 0) {
+      bounce = NULL;
+      errno = ENOMEM;
+      return NULL;
+    }
+    bounce_len = len;
+  }
+
+  return bounce;
+}
+
+static int pread_all (int fd, void *buf, size_t len, off_t offs)
+{
+  ssize_t res;
+
+  for (; len > 0; buf += res, len -= res, offs += res) {
+    res = pread(fd, buf, len, offs);
+    if (res <= 0) {
+      if ((res < 0) && (errno == EINTR)) {
+        res = 0;
+        continue;
+      }
+      if (res == 0)
+        errno = EIO;
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static int pwrite_all (int fd, const void *buf, size_t len, off_t offs)
+{
+  ssize_t res;
+
+  for (; len > 0; buf += res, len -= res, offs += res) {
+    res = pwrite(fd, buf, len, offs);
+    if (res < 0) {
+      if (errno == EINTR) {
+        res = 0;
+        continue;
+      }
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* daemon creates and preallocates a regular cachefile of cachefile_size
+   bytes; a block device is used as a whole */
+int slots_open (struct device *dev, int daemon, char const **errstr)
+{
+  struct stat st;
+  unsigned long long size;
+  int fd, res, blksz;
+
+  fd = open(dev->cachefile, O_RDWR|O_DIRECT|(daemon ? O_CREAT : 0),
+            S_IRUSR|S_IWUSR|S_IRGRP);
+  if (fd < 0)
+    goto ERROR;
+
+  if (fstat(fd, &st) != 0)
+    goto ERROR1;
+
+  if (S_ISBLK(st.st_mode)) {
+    if ((ioctl(fd, BLKGETSIZE64, &size) != 0) ||
+        (ioctl(fd, BLKSSZGET, &blksz) != 0))
+      goto ERROR1;
+    dev->direct_align = blksz;
+  } else if (S_ISREG(st.st_mode)) {
+    size = st.st_size;
+    if (daemon && (dev->cachefile_size > size)) {
+      res = posix_fallocate(fd, 0, dev->cachefile_size);
+      if (res != 0) {
+        errno = res;
+        goto ERROR1;
+      }
+      size = dev->cachefile_size;
+    }
+    dev->direct_align = DIRECT_ALIGN;
+  } else {
+    errno = EINVAL;
+    goto ERROR1;
+  }
+
+  if ((dev->direct_align == 0) || (dev->direct_align > DIRECT_ALIGN) ||
+      (DIRECT_ALIGN % dev->direct_align != 0)) {
+    *errstr = "unsupported logical block size";
+    close(fd);
+    return -1;
+  }
+
+  if (size / SLOT_SIZE > UINT32_MAX - 1)
+    size = (UINT32_MAX - 1) * SLOT_SIZE;
+
+  dev->num_slots = size / SLOT_SIZE;
+  if (dev->num_slots == 0) {
+    *errstr = "cachefile holds no slot";
+    close(fd);
+    return -1;
+  }
+
+  dev->cachefile_fd = fd;
+
+  return 0;
+
+ERROR1:
+  *errstr = strerror(errno);
+  close(fd);
+  return -1;
+
+ERROR:
+  *errstr = strerror(errno);
+  return -1;
+}
+
+void slots_close (struct device *dev)
+{
+  if (dev->num_slots == 0)
+    return;
+
+  close(dev->cachefile_fd);
+  dev->num_slots = 0;
+}
+
+/* assign the slots of map from their headers, see above */
+int slots_recover (struct device *dev, struct chunkmap *map)
+{
+  uint32_t *owners = CHUNKMAP_SLOTS(map), slot, other;
+  struct chunkmap_entry *entry;
+  struct slot_header *hdr;
+  uint64_t i, *seqs;
+  int result = -1;
+
+  hdr = (struct slot_header *) direct_bounce(SLOT_HEADER);
+  seqs = calloc(map->num_slots, sizeof(seqs[0]));
+  if ((hdr == NULL) || (seqs == NULL))
+    goto ERROR;
+
+  for (i = 0; i < map->num_chunks; i++) {
+    map->entries[i].flags &= ~CHUNK_CACHED;
+    map->entries[i].slot = 0;
+  }
+
+  memset(owners, 0, map->num_slots * sizeof(owners[0]));
+  map->slot_seq = 0;
+
+  for (slot = 0; slot < map->num_slots; slot++) {
+    if (pread_all(dev->cachefile_fd, hdr, SLOT_HEADER,
+                  SLOT_DATA(slot) - SLOT_HEADER) != 0)
+      goto ERROR;
+
+    if ((hdr->magic != SLOT_MAGIC) || (hdr->chunk_no >= map->num_chunks))
+      continue;
+
+    entry = &map->entries[hdr->chunk_no];
+    if (entry->slot != 0) {
+      other = entry->slot - 1;
+      if (seqs[other] > hdr->seq)
+        continue;
+      owners[other] = 0;
+    }
+
+    entry->slot = slot + 1;
+    entry->flags |= CHUNK_CACHED;
+    owners[slot] = hdr->chunk_no + 1;
+    seqs[slot] = hdr->seq;
+
+    if (hdr->seq > map->slot_seq)
+      map->slot_seq = hdr->seq;
+  }
+
+  result = 0;
+
+ERROR:
+  free(seqs);
+  return result;
+}
+
+/* claim a free slot for chunk_no; -1 if all are taken */
+int64_t slots_alloc (struct device *dev, uint64_t chunk_no)
+{
+  uint32_t *owners = CHUNKMAP_SLOTS(dev->chunkmap), slot, i;
+
+  for (i = 0; i < dev->num_slots; i++) {
+    slot = (dev->slot_hint + i) % dev->num_slots;
+    if ((owners[slot] == 0) &&
+        __sync_bool_compare_and_swap(&owners[slot], 0, chunk_no + 1)) {
+      dev->slot_hint = slot + 1;
+      return slot;
+    }
+  }
+
+  errno = ENOSPC;
+  return -1;
+}
+
+/* give up the slot of chunk_no, with the chunk locked exclusive; the
+   chunk stays cached if its header cannot be invalidated */
+int slots_free (struct device *dev, uint64_t chunk_no)
+{
+  struct chunkmap_entry *entry = &dev->chunkmap->entries[chunk_no];
+  uint32_t slot = entry->slot;
+  struct slot_header *hdr;
+
+  if (slot == 0) {
+    __sync_fetch_and_and(&entry->flags, ~CHUNK_CACHED);
+    return 0;
+  }
+
+  if ((hdr = (struct slot_header *) direct_bounce(SLOT_HEADER)) == NULL)
+    return -1;
+
+  __sync_fetch_and_and(&entry->flags, ~CHUNK_CACHED);
+
+  memset(hdr, 0, SLOT_HEADER);
+  if ((pwrite_all(dev->cachefile_fd, hdr, SLOT_HEADER,
+                  SLOT_DATA(slot - 1) - SLOT_HEADER) != 0) ||
+      (fdatasync(dev->cachefile_fd) != 0)) {
+    __sync_fetch_and_or(&entry->flags, CHUNK_CACHED);
+    return -1;
+  }
+
+  if (!__sync_bool_compare_and_swap(&entry->slot, slot, 0))
+    return 0;
+
+  __sync_synchronize();
+  CHUNKMAP_SLOTS(dev->chunkmap)[slot - 1] = 0;
+
+  return 0;
+}
+
+uint32_t slots_used (struct device *dev)
+{
+  uint32_t *owners = CHUNKMAP_SLOTS(dev->chunkmap), slot, used = 0;
+
+  for (slot = 0; slot < dev->num_slots; slot++)
+    used += (owners[slot] != 0);
+
+  return used;
+}
+
+/* with O_DIRECT, from a slot or a chunk file */
+int direct_pread (struct device *dev, int fd, void *buf, size_t len,
+                  off_t offs)
+{
+  off_t start = offs & ~((off_t) dev->direct_align - 1);
+  off_t end = (offs + len + dev->direct_align - 1) &
+              ~((off_t) dev->direct_align - 1);
+  char *b;
+
+  if ((start == offs) && (end == offs + (off_t) len) &&
+      ((uintptr_t) buf % dev->direct_align == 0))
+    return pread_all(fd, buf, len, offs);
+
+  if ((b = direct_bounce(end - start)) == NULL)
+    return -1;
+
+  if (pread_all(fd, b, end - start, start) != 0)
+    return -1;
+
+  memcpy(buf, b + (offs - start), len);
+
+  return 0;
+}
+
+/* partial blocks at either end are read, modified and written back, which
+   writes to other parts of the same blocks must not interleave with */
+int direct_pwrite (struct device *dev, int fd, const void *buf, size_t len,
+                   off_t offs)
+{
+  off_t start = offs & ~((off_t) dev->direct_align - 1);
+  off_t end = (offs + len + dev->direct_align - 1) &
+              ~((off_t) dev->direct_align - 1);
+  off_t last = end - dev->direct_align;
+  unsigned int lock1, lock2;
+  int head, tail, result = -1;
+  char *b;
+
+  head = (start != offs);
+  tail = (end != offs + (off_t) len);
+
+  if (!head && !tail && ((uintptr_t) buf % dev->direct_align == 0))
+    return pwrite_all(fd, buf, len, offs);
+
+  if ((b = direct_bounce(end - start)) == NULL)
+    return -1;
+
+  lock1 = (start / dev->direct_align) % DIRECT_LOCKS;
+  lock2 = (last / dev->direct_align) % DIRECT_LOCKS;
+  if (lock1 > lock2) {
+    lock1 ^= lock2;
+    lock2 ^= lock1;
+    lock1 ^= lock2;
+  }
+
+  if (head || tail) {
+    pthread_mutex_lock(&dev->direct_mtx[lock1]);
+    if (lock2 != lock1)
+      pthread_mutex_lock(&dev->direct_mtx[lock2]);
+  }
+
+  if (head && (pread_all(fd, b, dev->direct_align, start) != 0))
+    goto ERROR;
+
+  if (tail && (!head || (last != start)) &&
+      (pread_all(fd, b + (last - start), dev->direct_align, last) != 0))
+    goto ERROR;
+
+  memcpy(b + (offs - start), buf, len);
+  result = pwrite_all(fd, b, end - start, start);
+
+ERROR:
+  if (head || tail) {
+    if (lock2 != lock1)
+      pthread_mutex_unlock(&dev->direct_mtx[lock2]);
+    pthread_mutex_unlock(&dev->direct_mtx[lock1]);
+  }
+
+  return result;
+}
+
+/* put a whole chunk into a slot, with the chunk locked exclusive */
+int slot_fill (struct device *dev, int fd, uint32_t slot, uint64_t chunk_no,
+               const void *buf)
+{
+  struct slot_header *hdr;
+  off_t offs = SLOT_DATA(slot);
+
+  if ((hdr = (struct slot_header *) direct_bounce(SLOT_HEADER)) == NULL)
+    return -1;
+
+  memset(hdr, 0, SLOT_HEADER);
+  if ((pwrite_all(fd, hdr, SLOT_HEADER, offs - SLOT_HEADER) != 0) ||
+      (fdatasync(fd) != 0))
+    return -1;
+
+  if ((direct_pwrite(dev, fd, buf, CHUNKSIZE, offs) != 0) ||
+      (fdatasync(fd) != 0))
+    return -1;
+
+  /* direct_pwrite() may have used the bounce buffer */
+  if ((hdr = (struct slot_header *) direct_bounce(SLOT_HEADER)) == NULL)
+    return -1;
+
+  memset(hdr, 0, SLOT_HEADER);
+  hdr->magic = SLOT_MAGIC;
+  hdr->seq = __sync_add_and_fetch(&dev->chunkmap->slot_seq, 1);
+  hdr->chunk_no = chunk_no;
+
+  return pwrite_all(fd, hdr, SLOT_HEADER, offs - SLOT_HEADER);
+}
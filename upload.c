@@ -0,0 +1,852 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+
+#include "s3blkdev.h"
+
+/* uploading chunks to S3, shared by s3blkdev-sync and the write-back of
+   s3blkdevd. uploads run in a pool of threads, each with its own buffers
+   and connection, fed one chunk at a time. s3blkdev-sync prewarms the
+   cache with the same pool, s3blkdevd's warm-up with buffers of its own */
+
+#define logwarnx(fmt, params ...) do { \
+  syslog(LOG_WARNING, "%s (%s:%i): " fmt "\n", \
+         __FUNCTION__, __FILE__, __LINE__, ## params); \
+  if (upload_stderr) \
+    warnx("%s (%s:%i): " fmt, \
+          __FUNCTION__, __FILE__, __LINE__, ## params); \
+} while (0)
+
+#define logwarn(fmt, params ...) \
+  logwarnx(fmt ": %s", ## params, strerror(errno))
+
+struct uploader {
+  pthread_t thread;
+  struct config *cfg;
+  char *buf;
+  char *compbuf;
+  unsigned int conn_num;
+  int busy;
+  struct device *dev;
+  char *name;
+  enum eviction_mode evict;
+};
+
+static struct {
+  pthread_mutex_t mtx;
+  pthread_cond_t work;
+  pthread_cond_t idle;
+  struct uploader *ups;
+  unsigned int num_ups;
+} pool = {
+  PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+  PTHREAD_COND_INITIALIZER, NULL, 0
+};
+
+/* s3blkdev-sync reports problems on stderr, too */
+int upload_stderr = 0;
+
+/* upload a content-addressed object unless it is stored already */
+static int upload_cas (struct uploader *up, struct s3connection *s3conn,
+                       struct device *dev, char *hex, char *obj, size_t len)
+{
+  struct config *cfg = up->cfg;
+  char *buf = up->buf;
+  unsigned char local_md5[16], remote_md5[16];
+  unsigned short code;
+  size_t contentlen;
+  const char *err_str;
+  int res;
+
+  res = gnutls_hash_fast(GNUTLS_DIG_MD5, obj, len, local_md5);
+  if (res != GNUTLS_E_SUCCESS) {
+    logwarnx("gnutls_hash_fast(): %s", gnutls_strerror(res));
+    return -1;
+  }
+
+  res = s3_request(cfg, s3conn, &err_str, HEAD, CAS_FOLDER, hex, NULL, 0,
+                   local_md5, &code, &contentlen, remote_md5, buf,
+                   COMPR_CHUNKSIZE);
+  if (res != 0) {
+    logwarnx("s3_request(): %s/%s/%s/%s: %s", s3conn->host, s3conn->bucket,
+             CAS_FOLDER, hex, err_str);
+    return -1;
+  }
+
+  if ((code == 200) && !memcmp(local_md5, remote_md5, 16)) {
+    __sync_fetch_and_add(&dev->chunks_dedup, 1);
+    return 0;
+  }
+
+  if ((code != 200) && (code != 404)) {
+    logwarnx("s3_request(): %s/%s/%s/%s: HTTP status %hu", s3conn->host,
+             s3conn->bucket, CAS_FOLDER, hex, code);
+    return -1;
+  }
+
+  res = s3_request(cfg, s3conn, &err_str, PUT, CAS_FOLDER, hex, obj, len,
+                   local_md5, &code, &contentlen, remote_md5, buf,
+                   COMPR_CHUNKSIZE);
+  if (res != 0) {
+    logwarnx("s3_request(): %s/%s/%s/%s: %s", s3conn->host, s3conn->bucket,
+             CAS_FOLDER, hex, err_str);
+    return -1;
+  }
+
+  if (code != 200) {
+    logwarnx("s3_request(): %s/%s/%s/%s: HTTP status %hu", s3conn->host,
+             s3conn->bucket, CAS_FOLDER, hex, code);
+    return -1;
+  }
+
+  /* let other devices fetch it locally */
+  if ((cfg->casdir[0] != '\0') &&
+      (cas_store(cfg->casdir, hex, obj, len, &err_str) != 0))
+    logwarnx("cas_store(): %s/%s: %s", cfg->casdir, hex, err_str);
+
+  return 0;
+}
+
+/* st is the chunk's, to account for the space freed. the chunk is
+   unflagged before it goes, as s3blkdevd may fetch it anew right after */
+static void delete_chunk (int dir_fd, struct device *dev, char *name,
+                          char *path, struct stat *st,
+                          struct chunkmap_entry *entry)
+{
+  if (dev->num_slots > 0) {
+    if (slots_free(dev, entry - dev->chunkmap->entries) != 0) {
+      logwarn("slots_free(): %s/%s", dev->cachefile, name);
+      return;
+    }
+  } else {
+    if (entry != NULL)
+      __sync_fetch_and_and(&entry->flags, ~CHUNK_CACHED);
+
+    if (unlinkat(dir_fd, path, 0) != 0) {
+      logwarn("unlinkat(): %s/%s", dev->cachedir, name);
+      if (entry != NULL)
+        __sync_fetch_and_or(&entry->flags, CHUNK_CACHED);
+      return;
+    }
+  }
+
+  __sync_fetch_and_add(&dev->chunks_evicted, 1);
+  __sync_fetch_and_add(&dev->bytes_evicted,
+                       (unsigned long long) st->st_blocks * 512);
+
+  syslog(LOG_INFO, "evicted %s/%s\n", dev->cachedir, name);
+  *name = '\0';
+}
+
+/* is the manifest entry of a chunk recent enough to trust it? */
+int manifest_known (struct config *cfg, struct chunkmap_entry *entry,
+                    time_t now)
+{
+  return ((entry->verified != 0) &&
+          ((cfg->verify_interval == 0) ||
+           (now - entry->verified < cfg->verify_interval)));
+}
+
+/* check the md5 the manifest records for a chunk against S3; returns 1 if
+   S3 still holds that object, 0 if not */
+static int verify_chunk (struct uploader *up, struct device *dev, char *name,
+                         struct chunkmap_entry *entry)
+{
+  struct config *cfg = up->cfg;
+  struct s3connection *s3conn;
+  unsigned char remote_md5[16];
+  unsigned short code;
+  size_t contentlen;
+  const char *err_str;
+  int res, result = -1;
+
+  s3conn = s3_get_conn(cfg, &up->conn_num, &err_str);
+  if (s3conn == NULL) {
+    logwarnx("s3_get_conn(): %s", err_str);
+    goto ERROR;
+  }
+
+  res = s3_request(cfg, s3conn, &err_str, HEAD, dev->name, name, NULL, 0,
+                   entry->md5, &code, &contentlen, remote_md5, up->buf,
+                   COMPR_CHUNKSIZE);
+  if (res != 0) {
+    logwarnx("s3_request(): %s/%s/%s/%s: %s", s3conn->host, s3conn->bucket,
+            dev->name, name, err_str);
+    goto ERROR1;
+  }
+
+  if (code == 200) {
+    result = !memcmp(entry->md5, remote_md5, 16);
+  } else if (code == 404) {
+    result = 0;
+  } else {
+    logwarnx("s3_request(): %s/%s/%s/%s: HTTP status %hu", s3conn->host,
+            s3conn->bucket, dev->name, name, code);
+    goto ERROR1;
+  }
+
+  if (result)
+    entry->verified = time(NULL);
+  else
+    logwarnx("%s/%s/%s/%s differs from manifest",
+             s3conn->host, s3conn->bucket, dev->name, name);
+
+ERROR1:
+  s3_release_conn(s3conn);
+
+ERROR:
+  return result;
+}
+
+static void sync_chunk (struct uploader *up, struct device *dev, char *name,
+                        enum eviction_mode evict)
+{
+  struct config *cfg = up->cfg;
+  char *buf = up->buf, *compbuf = up->compbuf;
+  int dir_fd = -1, fd, lock_fd = -1, flags, equal, known = 0, res;
+  struct chunkmap_entry *entry = NULL;
+  unsigned long long chunk_no;
+  uint32_t gen = 0;
+  off_t offs = 0;
+  time_t read_time;
+  struct flock flk;
+  struct stat st, st0;
+  size_t comprlen, objlen;
+  unsigned char local_md5[16], remote_md5[16], digest[CAS_DIGEST_SIZE];
+  char ref[CODEC_REF_SIZE], hex[CAS_HEX_SIZE], *obj, path[CHUNK_PATH_SIZE];
+  struct s3connection *s3conn = NULL;
+  unsigned short code;
+  size_t contentlen;
+  const char *err_str;
+
+  chunk_no = strtoull(name, NULL, 16);
+
+  /* s3blkdevd's threads only heed the chunk's lock in the map; without
+     the map, s3blkdevd is not running */
+  if ((dev->chunkmap != NULL) && (chunk_no < dev->chunkmap->num_chunks)) {
+    lock_fd = chunk_lock_sync(dev, chunk_no, evict != SYNC_ONLY);
+    if (lock_fd < 0) {
+      logwarn("cannot lock %s/%s", dev->cachedir, name);
+      goto ERROR;
+    }
+  }
+
+  if (dev->num_slots > 0) {
+    /* evicted meanwhile */
+    if ((lock_fd < 0) ||
+        !(dev->chunkmap->entries[chunk_no].flags & CHUNK_CACHED))
+      goto ERROR;
+    fd = dev->cachefile_fd;
+    offs = SLOT_DATA(dev->chunkmap->entries[chunk_no].slot - 1);
+    st.st_blocks = CHUNKSIZE / 512;
+    goto LOCKED;
+  }
+
+  dir_fd = open(dev->cachedir, O_RDONLY|O_DIRECTORY);
+  if (dir_fd < 0) {
+    logwarn("open(): %s", dev->cachedir);
+    goto ERROR;
+  }
+
+  /* open and lock chunk, which may still be in the other layout */
+  chunk_path(name, dev->hashed, path);
+  flags = (evict == SYNC_ONLY ? O_RDONLY : O_RDWR) | O_NOATIME |
+          (dev->direct ? O_DIRECT : 0);
+  fd = openat(dir_fd, path, flags);
+  if ((fd < 0) && (errno == ENOENT) &&
+      (chunk_migrate(dir_fd, dev, name) > 0))
+    fd = openat(dir_fd, path, flags);
+  if (fd < 0) {
+    logwarn("open(): %s/%s", dev->cachedir, name);
+    goto ERROR1;
+  }
+
+  flk.l_type = (evict == SYNC_ONLY ? F_RDLCK : F_WRLCK);
+  flk.l_whence = SEEK_SET;
+  flk.l_start = 0;
+  flk.l_len = CHUNKSIZE;
+  flk.l_pid = 0;
+
+  if ((lock_fd < 0) && (fcntl(fd, F_OFD_SETLK, &flk) != 0)) {
+    logwarn("cannot lock %s/%s", dev->cachedir, name);
+    goto ERROR2;
+  }
+
+  if (fstatat(dir_fd, path, &st0, 0) != 0) {
+    /* chunk was removed while we waited for the lock */
+    if (errno != ENOENT) {
+      logwarn("fstatat(): %s/%s", dev->cachedir, name);
+    }
+
+    goto ERROR2;
+  }
+
+  if (fstat(fd, &st) != 0) {
+    logwarn("fstat(): %s/%s", dev->cachedir, name);
+    goto ERROR2;
+  }
+
+  if (st.st_ino != st0.st_ino) {
+    /* the file we opened and the current file on disk are not the same */
+    goto ERROR2;
+  }
+
+  if (st.st_size != CHUNKSIZE) {
+    /* chunk is being fetched by s3blkdev */
+    logwarnx("%s/%s: filesize %lu != CHUNKSIZE",
+             dev->cachedir, name, st.st_size);
+    goto ERROR2;
+  }
+
+LOCKED:
+  /* chunks not written to since their last upload are in S3 already,
+     which gets verified every verify_interval seconds */
+  if ((dev->chunkmap != NULL) && (chunk_no < dev->chunkmap->num_chunks)) {
+    entry = &dev->chunkmap->entries[chunk_no];
+    gen = entry->gen;
+    known = manifest_known(cfg, entry, time(NULL));
+
+    if (gen == entry->synced_gen) {
+      res = known;
+      if (!known && (entry->verified != 0))
+        res = verify_chunk(up, dev, name, entry);
+      if (res < 0)
+        goto ERROR2;
+
+      if (res) {
+        if (evict != SYNC_ONLY)
+          delete_chunk(dir_fd, dev, name, path, &st, entry);
+        goto ERROR2;
+      }
+    }
+  }
+
+  /* read chunk */
+  read_time = time(NULL);
+  if (dev->num_slots > 0) {
+    if (direct_pread(dev, fd, buf, CHUNKSIZE, offs) != 0) {
+      logwarn("pread(): %s/%s", dev->cachefile, name);
+      goto ERROR2;
+    }
+  } else if (read(fd, buf, CHUNKSIZE) != CHUNKSIZE) {
+    logwarn("read(): %s/%s", dev->cachedir, name);
+    goto ERROR2;
+  }
+
+  /* compress chunk. content-addressed objects are shared by chunks, so
+     only objects of the device are bound to the chunk */
+  comprlen = COMPR_CHUNKSIZE;
+  res = chunk_compress(dev->codec, dev->codec_level, dev->min_saving,
+                       (dev->encrypt ? dev->key : NULL),
+                       (dev->dedup ? NULL : dev->name), chunk_no, buf,
+                       CHUNKSIZE, compbuf, &comprlen, &err_str);
+  if (res < 0) {
+    logwarnx("chunk_compress(): %s/%s: %s", dev->cachedir, name, err_str);
+    goto ERROR2;
+  }
+
+  __sync_fetch_and_add(&dev->chunks_coded, 1);
+  if (res == CODEC_NONE)
+    __sync_fetch_and_add(&dev->chunks_raw, 1);
+
+  /* with dedup, the device's object just refers to the content-addressed
+     one */
+  obj = compbuf;
+  objlen = comprlen;
+  if (dev->dedup) {
+    if (cas_hash(compbuf, comprlen, digest, hex, &err_str) != 0) {
+      logwarnx("cas_hash(): %s/%s: %s", dev->cachedir, name, err_str);
+      goto ERROR2;
+    }
+    obj = ref;
+    objlen = chunk_make_ref(compbuf, digest, ref);
+  }
+
+  /* get md5 of chunk */
+  res = gnutls_hash_fast(GNUTLS_DIG_MD5, obj, objlen, local_md5);
+  if (res != GNUTLS_E_SUCCESS) {
+    logwarnx("gnutls_hash_fast(): %s", gnutls_strerror(res));
+    goto ERROR2;
+  }
+
+  if (known) {
+    /* the manifest tells what S3 holds */
+    equal = !memcmp(local_md5, entry->md5, 16);
+  } else {
+    /* fetch md5 (etag) */
+    s3conn = s3_get_conn(cfg, &up->conn_num, &err_str);
+    if (s3conn == NULL) {
+      logwarnx("s3_get_conn(): %s", err_str);
+      goto ERROR2;
+    }
+
+    res = s3_request(cfg, s3conn, &err_str, HEAD, dev->name, name, NULL, 0,
+                     local_md5, &code, &contentlen, remote_md5, buf,
+                     COMPR_CHUNKSIZE);
+    if (res != 0) {
+      logwarnx("s3_request(): %s/%s/%s/%s: %s", s3conn->host, s3conn->bucket,
+              dev->name, name, err_str);
+      goto ERROR3;
+    }
+
+    if (code == 200) {
+      /* found chunk, compare md5 checksum to local one */
+      equal = !memcmp(local_md5, remote_md5, 16);
+    } else if (code == 404) {
+      /* chunk not found */
+      equal = 0;
+    } else {
+      logwarnx("s3_request(): %s/%s/%s/%s: HTTP status %hu", s3conn->host,
+              s3conn->bucket, dev->name, name, code);
+      goto ERROR3;
+    }
+  }
+
+  if (!equal && (evict != DELETE_IF_EQUAL)) {
+    /* upload chunk */
+    if (s3conn == NULL) {
+      s3conn = s3_get_conn(cfg, &up->conn_num, &err_str);
+      if (s3conn == NULL) {
+        logwarnx("s3_get_conn(): %s", err_str);
+        goto ERROR2;
+      }
+    }
+
+    if (dev->dedup &&
+        (upload_cas(up, s3conn, dev, hex, compbuf, comprlen) != 0))
+      goto ERROR3;
+
+    res = s3_request(cfg, s3conn, &err_str, PUT, dev->name, name, obj,
+                     objlen, local_md5, &code, &contentlen, remote_md5, buf,
+                     COMPR_CHUNKSIZE);
+    if (res != 0) {
+      logwarnx("s3_request(): %s/%s/%s/%s: %s", s3conn->host, s3conn->bucket,
+              dev->name, name, err_str);
+      goto ERROR3;
+    }
+
+    if (code != 200) {
+      logwarnx("s3_request(): %s/%s/%s/%s: HTTP status %hu", s3conn->host,
+              s3conn->bucket, dev->name, name, code);
+      goto ERROR3;
+    }
+
+    syslog(LOG_INFO, "synced %s/%s\n", dev->cachedir, name);
+  }
+
+  /* S3 holds what was read above, unless written to meanwhile */
+  if ((entry != NULL) && (equal || (evict != DELETE_IF_EQUAL))) {
+    memcpy(entry->md5, local_md5, 16);
+    if (s3conn != NULL)
+      entry->verified = time(NULL);
+    /* if written to meanwhile, the chunk is dirty since it was read */
+    entry->dirtied = read_time;
+    __sync_synchronize();
+    entry->synced_gen = gen;
+  }
+
+  if ((equal && (evict == DELETE_IF_EQUAL)) || (evict == SYNC_AND_DELETE))
+    delete_chunk(dir_fd, dev, name, path, &st, entry);
+
+ERROR3:
+  if (s3conn != NULL)
+    s3_release_conn(s3conn);
+
+ERROR2:
+  if ((dev->num_slots == 0) && (close(fd) < 0))
+    logwarn("close(): %s/%s", dev->cachedir, name);
+
+ERROR1:
+  if ((dir_fd >= 0) && (close(dir_fd) < 0))
+    logwarn("close(): %s", dev->cachedir);
+
+ERROR:
+  if (lock_fd >= 0)
+    chunk_unlock_sync(dev, chunk_no, evict != SYNC_ONLY, lock_fd);
+}
+
+/* fetch the object of a chunk, or the content-addressed one it refers to,
+   into compbuf; returns 1 if S3 has none */
+static int prewarm_fetch (struct uploader *up, struct device *dev,
+                          char *name, unsigned char *md5, size_t *contentlen)
+{
+  struct config *cfg = up->cfg;
+  unsigned char digest[CAS_DIGEST_SIZE], cas_md5[16];
+  char hex[CAS_HEX_SIZE], *folder = dev->name, *obj = name;
+  unsigned short code;
+  const char *err_str;
+  int res;
+
+  if (s3_get(cfg, &up->conn_num, &err_str, folder, obj, &code, contentlen,
+             md5, up->compbuf, COMPR_CHUNKSIZE) != 0)
+    goto ERROR;
+
+  if ((code == 200) && chunk_parse_ref(up->compbuf, *contentlen, digest)) {
+    __sync_fetch_and_add(&dev->bytes_prewarmed, *contentlen);
+    cas_hex(digest, hex);
+
+    if (cfg->casdir[0] != '\0') {
+      res = cas_load(cfg->casdir, hex, up->compbuf, COMPR_CHUNKSIZE,
+                     contentlen, &err_str);
+      if (res < 0)
+        logwarnx("cas_load(): %s/%s: %s", cfg->casdir, hex, err_str);
+      if (res == 0)
+        return 0;
+    }
+
+    folder = CAS_FOLDER;
+    obj = hex;
+    if (s3_get(cfg, &up->conn_num, &err_str, folder, obj, &code, contentlen,
+               cas_md5, up->compbuf, COMPR_CHUNKSIZE) != 0)
+      goto ERROR;
+
+    if ((code == 200) && (cfg->casdir[0] != '\0') &&
+        (cas_store(cfg->casdir, hex, up->compbuf, *contentlen,
+                   &err_str) != 0))
+      logwarnx("cas_store(): %s/%s: %s", cfg->casdir, hex, err_str);
+  }
+
+  if ((code == 404) && (folder == dev->name))
+    return 1;
+
+  if (code != 200) {
+    logwarnx("s3_get(): %s/%s/%s: HTTP status %hu", cfg->s3bucket, folder,
+             obj, code);
+    return -1;
+  }
+
+  __sync_fetch_and_add(&dev->bytes_prewarmed, *contentlen);
+
+  return 0;
+
+ERROR:
+  logwarnx("s3_get(): %s/%s/%s: %s", cfg->s3bucket, folder, obj, err_str);
+  return -1;
+}
+
+/* fetch a chunk into the cache, unless it is there already, the way
+   s3blkdevd does on reading it. chunks S3 has none of are all zeros, and
+   not worth caching ahead. unless touch is set, the chunk's access
+   statistics stay as they are */
+static void prewarm_chunk (struct uploader *up, struct device *dev,
+                           char *name, int touch)
+{
+  char path[CHUNK_PATH_SIZE];
+  int dir_fd = -1, fd = -1, lock_fd = -1, flags, res;
+  struct chunkmap_entry *entry = NULL;
+  unsigned long long chunk_no;
+  unsigned char md5[16];
+  size_t contentlen, uncomplen;
+  const char *err_str;
+  struct flock flk;
+  struct stat st;
+  int64_t slot;
+
+  chunk_no = strtoull(name, NULL, 16);
+
+  /* if s3blkdevd uses the chunk, it is cached or about to be */
+  if ((dev->chunkmap != NULL) && (chunk_no < dev->chunkmap->num_chunks)) {
+    entry = &dev->chunkmap->entries[chunk_no];
+    if (entry->flags & CHUNK_CACHED)
+      goto ERROR;
+
+    lock_fd = chunk_lock_sync(dev, chunk_no, 1);
+    if (lock_fd < 0) {
+      if (errno != EAGAIN)
+        logwarn("cannot lock %s/%s", dev->cachedir, name);
+      goto ERROR;
+    }
+
+    if (entry->flags & CHUNK_CACHED)
+      goto ERROR;
+  }
+
+  if (dev->num_slots > 0) {
+    if (lock_fd < 0)
+      goto ERROR;
+  } else {
+    dir_fd = open(dev->cachedir, O_RDONLY|O_DIRECTORY);
+    if (dir_fd < 0) {
+      logwarn("open(): %s", dev->cachedir);
+      goto ERROR;
+    }
+
+    /* the chunk may still be in the other layout */
+    chunk_path(name, dev->hashed, path);
+    flags = O_RDWR | (dev->direct ? O_DIRECT : 0);
+    fd = openat(dir_fd, path, flags);
+    if ((fd < 0) && (errno == ENOENT)) {
+      if (chunk_migrate(dir_fd, dev, name) < 0) {
+        logwarn("chunk_migrate(): %s/%s", dev->cachedir, name);
+        goto ERROR1;
+      }
+      fd = openat(dir_fd, path, flags|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP);
+    }
+    if (fd < 0) {
+      logwarn("open(): %s/%s", dev->cachedir, name);
+      goto ERROR1;
+    }
+
+    /* without the map, s3blkdevd is not running */
+    flk.l_type = F_WRLCK;
+    flk.l_whence = SEEK_SET;
+    flk.l_start = 0;
+    flk.l_len = CHUNKSIZE;
+    flk.l_pid = 0;
+
+    if ((lock_fd < 0) && (fcntl(fd, F_OFD_SETLK, &flk) != 0))
+      goto ERROR2;
+
+    if (fstat(fd, &st) != 0) {
+      logwarn("fstat(): %s/%s", dev->cachedir, name);
+      goto ERROR2;
+    }
+
+    if (st.st_size == CHUNKSIZE)
+      goto ERROR2;
+  }
+
+  memset(md5, 0, sizeof(md5));
+  res = prewarm_fetch(up, dev, name, md5, &contentlen);
+  if (res != 0) {
+    if ((res > 0) && (fd >= 0) && (st.st_size == 0) &&
+        (unlinkat(dir_fd, path, 0) != 0))
+      logwarn("unlinkat(): %s/%s", dev->cachedir, name);
+    goto ERROR2;
+  }
+
+  uncomplen = COMPR_CHUNKSIZE;
+  res = chunk_uncompress((dev->encrypt ? dev->key : NULL), dev->name,
+                         chunk_no, up->compbuf, contentlen, up->buf,
+                         &uncomplen, &err_str);
+  if (res < 0) {
+    logwarnx("chunk_uncompress(): %s/%s: %s", dev->name, name, err_str);
+    goto ERROR2;
+  }
+  if (uncomplen != CHUNKSIZE) {
+    logwarnx("chunk_uncompress(): %s/%s: uncomplen %lu, expected %u",
+             dev->name, name, uncomplen, CHUNKSIZE);
+    goto ERROR2;
+  }
+
+  if (dev->num_slots > 0) {
+    /* a slot may be left from a failed fetch */
+    slot = (int64_t) entry->slot - 1;
+    if (slot < 0) {
+      slot = slots_alloc(dev, chunk_no);
+      if (slot < 0) {
+        logwarn("slots_alloc(): %s", dev->cachefile);
+        goto ERROR2;
+      }
+      entry->slot = slot + 1;
+    }
+
+    if (slot_fill(dev, dev->cachefile_fd, slot, chunk_no, up->buf) != 0) {
+      logwarn("slot_fill(): %s", dev->cachefile);
+      goto ERROR2;
+    }
+  } else if (dev->direct) {
+    if (direct_pwrite(dev, fd, up->buf, CHUNKSIZE, 0) != 0) {
+      logwarn("pwrite(): %s/%s", dev->cachedir, name);
+      goto ERROR2;
+    }
+  } else if (pwrite(fd, up->buf, CHUNKSIZE, 0) != CHUNKSIZE) {
+    logwarn("pwrite(): %s/%s", dev->cachedir, name);
+    goto ERROR2;
+  }
+
+  if (entry != NULL) {
+    chunk_fetched(dev, chunk_no, md5);
+    if (touch)
+      chunk_touch(dev, chunk_no);
+    else
+      __sync_fetch_and_or(&entry->flags, CHUNK_CACHED);
+  }
+
+  __sync_fetch_and_add(&dev->chunks_prewarmed, 1);
+
+  syslog(LOG_INFO, "prewarmed %s/%s\n", dev->cachedir, name);
+
+ERROR2:
+  if ((fd >= 0) && (close(fd) < 0))
+    logwarn("close(): %s/%s", dev->cachedir, name);
+
+ERROR1:
+  if ((dir_fd >= 0) && (close(dir_fd) < 0))
+    logwarn("close(): %s", dev->cachedir);
+
+ERROR:
+  if (lock_fd >= 0)
+    chunk_unlock_sync(dev, chunk_no, 1, lock_fd);
+}
+
+static void *uploader (void *arg)
+{
+  struct uploader *up = (struct uploader*) arg;
+  sigset_t sigset;
+
+  /* leave signals to the main thread */
+  sigfillset(&sigset);
+  pthread_sigmask(SIG_SETMASK, &sigset, NULL);
+
+  pthread_mutex_lock(&pool.mtx);
+
+  for (;;) {
+    while (!up->busy)
+      pthread_cond_wait(&pool.work, &pool.mtx);
+
+    pthread_mutex_unlock(&pool.mtx);
+
+    if (up->evict == PREWARM)
+      prewarm_chunk(up, up->dev, up->name, 1);
+    else
+      sync_chunk(up, up->dev, up->name, up->evict);
+
+    pthread_mutex_lock(&pool.mtx);
+    up->busy = 0;
+    pthread_cond_signal(&pool.idle);
+  }
+
+  return NULL;
+}
+
+static int uploader_init (struct uploader *up, struct config *cfg,
+                          unsigned int conn_num, char const **errstr)
+{
+  up->cfg = cfg;
+  up->conn_num = conn_num;
+  /* aligned for reading slots with O_DIRECT */
+  if (posix_memalign((void **) &up->buf, DIRECT_ALIGN, COMPR_CHUNKSIZE) != 0)
+    up->buf = NULL;
+  up->compbuf = malloc(COMPR_CHUNKSIZE);
+  if ((up->buf == NULL) || (up->compbuf == NULL)) {
+    *errstr = "malloc() failed";
+    return -1;
+  }
+
+  return 0;
+}
+
+/* conn_num is where the uploaders start looking for a free connection */
+int upload_start_workers (struct config *cfg, unsigned int num_threads,
+                          unsigned int conn_num, char const **errstr)
+{
+  struct uploader *up;
+  unsigned int i;
+  int res;
+
+  pool.ups = calloc(num_threads, sizeof(pool.ups[0]));
+  if (pool.ups == NULL) {
+    *errstr = "calloc() failed";
+    return -1;
+  }
+
+  for (i = 0; i < num_threads; i++) {
+    up = &pool.ups[i];
+    if (uploader_init(up, cfg, conn_num + i, errstr) != 0)
+      return -1;
+
+    if ((res = pthread_create(&up->thread, NULL, &uploader, up)) != 0) {
+      *errstr = strerror(res);
+      return -1;
+    }
+
+    pool.num_ups++;
+  }
+
+  return 0;
+}
+
+/* hand a chunk to the next idle uploader, wait for one if necessary; name
+   must stay valid until upload_wait() */
+void upload_chunk (struct device *dev, char *name, enum eviction_mode evict)
+{
+  struct uploader *up;
+  unsigned int i;
+
+  pthread_mutex_lock(&pool.mtx);
+
+  for (;;) {
+    for (i = 0; (i < pool.num_ups) && pool.ups[i].busy; i++);
+    if (i < pool.num_ups)
+      break;
+    pthread_cond_wait(&pool.idle, &pool.mtx);
+  }
+
+  up = &pool.ups[i];
+  up->dev = dev;
+  up->name = name;
+  up->evict = evict;
+  up->busy = 1;
+  pthread_cond_broadcast(&pool.work);
+
+  pthread_mutex_unlock(&pool.mtx);
+}
+
+void upload_wait ()
+{
+  unsigned int i;
+
+  pthread_mutex_lock(&pool.mtx);
+
+  for (;;) {
+    for (i = 0; (i < pool.num_ups) && !pool.ups[i].busy; i++);
+    if (i == pool.num_ups)
+      break;
+    pthread_cond_wait(&pool.idle, &pool.mtx);
+  }
+
+  pthread_mutex_unlock(&pool.mtx);
+}
+
+/* buffers and a connection to prewarm chunks with outside the pool, one at
+   a time, such as the warm-up of s3blkdevd does */
+struct uploader *upload_prewarmer (struct config *cfg, unsigned int conn_num,
+                                   char const **errstr)
+{
+  struct uploader *up;
+
+  up = calloc(1, sizeof(*up));
+  if (up == NULL) {
+    *errstr = "calloc() failed";
+    return NULL;
+  }
+
+  if (uploader_init(up, cfg, conn_num, errstr) != 0) {
+    free(up->buf);
+    free(up->compbuf);
+    free(up);
+    return NULL;
+  }
+
+  return up;
+}
+
+void upload_prewarmer_free (struct uploader *up)
+{
+  if (up == NULL)
+    return;
+
+  free(up->buf);
+  free(up->compbuf);
+  free(up);
+}
+
+/* unlike the prewarming of s3blkdev-sync, the chunk does not count as
+   used by that */
+void upload_prewarm (struct uploader *up, struct device *dev, char *name)
+{
+  prewarm_chunk(up, dev, name, 0);
+}